@@ -1,52 +1,841 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
 #include <string.h>
+#include <getopt.h>
 #include <unistd.h>
-#include <sys/wait.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
 #include <sys/sysinfo.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include <libvirt/libvirt.h>
 
 #define MAX_VM_NAME_LENGTH 64
-#define MAX_NUM_OF_VM 1024
+#define MAX_NUM_OF_VM 4096
+#define MAX_NUM_OF_WORKER 64
+#define VM_CACHE_BUCKETS (2 * MAX_NUM_OF_VM)  // power of two, load factor <= 0.5
+#define MAX_NUM_OF_POLICY 256
+#define POLICY_BUCKETS (2 * MAX_NUM_OF_POLICY)
+
+#define DEFAULT_URI "qemu:///system"
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_READ_BUFFER 8192     // memory.stat is a few KB
+
+#define SIM_DAY 86400               // period of the simulated demand wave, in seconds
+#define SIM_BURST_WINDOW 900        // seconds, a burst may start once per window
+#define SIM_BALLOON_LATENCY 1       // seconds before a resize starts to move the balloon
+#define SIM_BALLOON_RATE (128 << 10)    // KB/s the simulated balloon moves at
+#define SIM_TOUCH 60                // seconds a guest takes to touch all of its working set
+
+#define LOG_RING_SIZE 4096      // power of two
+#define LOG_TEXT_LENGTH 192
+#define LOG_RATE_LIMIT 50       // text messages per level per second
+#define LOG_IDLE_US 10000       // log_flush polls the writer this often
+#define LOG_FLUSH_MS 1000       // an idle writer still wakes this often, to report drops
+
+#define HISTOGRAM_BUCKETS 16
+#define METRICS_CLIENT_TIMEOUT 2    // seconds a scrape gets to send its request and take the reply
+
+#define MAX_RPC_SITES 64
+#define PROFILE_SUB_BUCKETS 16  // power of two
+#define PROFILE_MAX_POWER 40    // 2^40ns, about 18 minutes
+#define PROFILE_BUCKETS ((PROFILE_MAX_POWER - 2) * PROFILE_SUB_BUCKETS)
 
 #define CONFIG_LOW_THRESHOLD_DEFAULT 0.7
 #define CONFIG_HIGH_THRESHOLD_DEFAULT 0.85
 #define CONFIG_INTERVAL_DEFAULT (long int) 5
 #define CONFIG_SPEED_DEFAULT (long int) (32 << 10)
+#define CONFIG_CONTROLLER_DEFAULT "threshold"
+#define CONFIG_TARGET_PRESSURE_DEFAULT 0.78
+#define CONFIG_KP_DEFAULT 0.5
+#define CONFIG_KI_DEFAULT 0.05
+#define CONFIG_KD_DEFAULT 0.1
+#define CONFIG_MAX_STEP_DEFAULT (long int) (256 << 10)
+#define CONFIG_FORECAST_ALPHA_DEFAULT 0.5
+#define CONFIG_FORECAST_BETA_DEFAULT 0.3
+#define CONFIG_FORECAST_HORIZON_DEFAULT 2
+#define CONFIG_HOST_MIN_FREE_DEFAULT (long int) (1 << 20)
+#define CONFIG_RESIZE_TIMEOUT_DEFAULT (long int) 30
+#define CONFIG_MIN_INTERVAL_DEFAULT (long int) 1
+#define CONFIG_MAX_INTERVAL_DEFAULT (long int) 15
+#define CONFIG_SWAP_IN_LIMIT_DEFAULT (long int) 4096
+#define CONFIG_FAULT_LIMIT_DEFAULT (long int) 1000
+#define CONFIG_PSI_LIMIT_DEFAULT 0.1
+#define CONFIG_MIN_MEMORY_SHARE_DEFAULT 0.25
+#define CONFIG_RATE_LIMIT_DEFAULT (long int) (2 << 20)
+#define CONFIG_COOLDOWN_DEFAULT (long int) 60
+
+#define SCHEDULE_SLACK_MS 250   // VMs due this close together are sampled in one sweep
+#define ADAPT_MOVE 32           // a resize over 1/ADAPT_MOVE of max counts as movement
+#define ADAPT_DRIFT 0.02        // demand change per sample, as a share of max, that counts as fast
+#define DISTRESS_BOOST 3        // extra deflate steps a fully distressed guest gets per tick
+
+#define RESIZE_SLACK (long int) (4 << 10)   // KB a balloon may settle away from its target
+#define THRASH_WINDOW 300                   // seconds, a resize reversing the last one this soon is thrash
+
+#define FORECAST_WINDOW 8
 
-#define CONFIG_FILE "/etc/balloon/default.conf"
-#define ERROR_LOG_FILE "/var/log/balloon/error.log"
+#define PRIORITY_BATCH 0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_HIGH 2
+#define PRIORITY_CRITICAL 3
+
+/* <balloon:balloon tag="..."/> in the domain XML selects a [tag:...] policy */
+#define BALLOON_METADATA_URI "urn:vdt:balloon"
+
+#define TRACE_MAGIC "BLNTRACE"
+#define TRACE_VERSION 2
+#define TRACE_BUFFER (3 * MAX_NUM_OF_VM)    // records, more than a sweep's worth
+#define TRACE_IN_FLIGHT 1                   // tick flag: no decision, a resize was moving
+
+#define CHECKPOINT_MAGIC "BLNSTATE"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_INTERVAL 60              // seconds between checkpoints while running
+
+#define CONFIG_DIR "/etc/balloon"
+#define CONFIG_FILE_NAME "default.conf"
+#define CONFIG_FILE CONFIG_DIR "/" CONFIG_FILE_NAME
+#define LOG_DIR "/var/log/balloon"
+#define ERROR_LOG_FILE LOG_DIR "/error.log"
+#define STATE_DIR "/var/lib/balloon"
+#define CHECKPOINT_FILE STATE_DIR "/checkpoint"
+
+typedef struct balloon_controller balloon_controller;
 
 typedef struct {
     float low_threshold;
     float high_threshold;
     long int interval;
     long int speed;
+    const balloon_controller *controller;
+    float target_pressure;      // pid: pressure the controller steers to
+    float kp, ki, kd;           // pid: gains, in KB of step per KB of max per unit of error
+    long int max_step;          // pid: slew-rate limit per tick, in KB
+    float forecast_alpha;       // predictive: Holt smoothing of the level
+    float forecast_beta;        // predictive: Holt smoothing of the trend
+    long int forecast_horizon;  // predictive: ticks to look ahead
+    long int host_min_free;     // host free memory the arbiter never plans below, in KB
+    long int min_memory;        // floor for the balloon size, in KB
+    long int max_memory;        // ceiling for the balloon size in KB, 0 is the domain max
+    int priority;               // higher is served first by the host arbiter
+    long int resize_timeout;    // seconds a resize may take before the VM is acted on again
+    long int min_interval;      // bounds of the per-VM sampling period, in seconds
+    long int max_interval;
+    long int swap_in_limit;     // guest swap-in rate that counts as full distress, in KB/s, 0 ignores it
+    long int fault_limit;       // same for major faults, in faults/s
+    float psi_limit;            // same for the share of time the VM's host cgroup stalls on memory
+    float min_memory_share;     // hard floor for the balloon size, as a share of the guest's RAM
+    long int rate_limit;        // KB the balloon may move per minute, 0 is unlimited
+    long int cooldown;          // seconds after a resize before one the other way
 } balloon_config;
 
+enum { POLICY_MATCH_NAME, POLICY_MATCH_UUID, POLICY_MATCH_TAG };
+
+typedef struct {
+    int match;
+    char key[MAX_VM_NAME_LENGTH];
+    balloon_config config;      // the global section with this section's overrides
+} vm_policy;
+
+/* everything read from the config file, policies indexed by (match, key) */
+typedef struct {
+    balloon_config global;
+    vm_policy policies[MAX_NUM_OF_POLICY];
+    int num_policies;
+    int index[POLICY_BUCKETS];
+} balloon_settings;
+
 typedef struct {    // in KB
     long int actual;
     long int available;
     long int max;
+    long int last_update;   // guest timestamp of the stats, in seconds
+    long int unused;        // free, page cache not included
+    long int disk_caches;   // page cache, which the guest can drop
+    long int swap_in;       // since guest boot
+    long int major_faults;  // since guest boot, a count
+    long int rss;           // guest memory QEMU holds on the host, 0 without a cgroup
+    float stall;            // share of time the host cgroup stalled on memory since the last read
+    float distress;         // swap-in, fault and stall rates since the previous sample, 0 to 1
 } vm_info;
 
-virConnectPtr connection = NULL;
+typedef struct {    // in KB
+    long int actual;
+    long int available;
+} vm_sample;
+
+/* per-VM memory of a controller, zeroed when the domain shows up; fixed size */
+typedef struct {
+    double integral;
+    double prev_error;
+    int primed;
+    vm_sample samples[FORECAST_WINDOW];     // ring of the last samples, oldest at head
+    int head, num_samples;
+    double level, trend;                    // Holt state of used memory, in KB and KB/tick
+} controller_state;
+
+/* per-VM state of the safety rails, see the Safety Rails section */
+typedef struct {
+    double tokens;              // KB of movement left in the bucket
+    double refilled_at;         // backend clock, in ms
+    double acted_at;            // last resize queued
+    int direction;              // of that resize: 1 gave the guest memory, -1 took it
+    int primed;                 // the bucket has been filled once
+} rail_state;
+
+/* a balloon policy: returns the new balloon size in KB, vm->actual to hold */
+struct balloon_controller {
+    const char *name;
+    long int (*decide)(controller_state *state, const vm_info *vm, const balloon_config *config);
+};
+
+typedef struct {
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    void *dom;                          // owned backend handle on the main connection
+    void *shard_dom;                    // same domain on its worker's connection
+    vm_info sample;                     // this sweep's bulk stats
+    int bulk;                           // sample is valid
+    int id;
+    char name[MAX_VM_NAME_LENGTH];
+    long int max;                       // in KB
+    long int period;                    // stats period currently set in the guest
+    long int sample_period;             // seconds, adapted after every decision
+    double next_sample;                 // backend clock, in ms
+    int heap_pos;                       // 1-based index in schedule_heap, 0 while out
+    int due;                            // sampled in the current sweep
+    float last_used;                    // demand at the last decision, as a share of max
+    vm_info shown;                      // last applied sample and target, for the exporter
+    long shown_target;
+    long int last_update;               // stats timestamp the last decision was made on
+    long int swap_in, major_faults;     // guest counters at stats_at
+    double stats_at;                    // seconds, guest or backend clock
+    float distress;                     // guest part, the host stall is added per sample
+    int cgroup_pressure, cgroup_stat;   // open memory.pressure and memory.stat, -1 if none
+    unsigned long long psi_total;       // "some" stall at psi_at, in us
+    double psi_at;                      // seconds, monotonic
+    float stall;
+    long int fresh_rss, fresh_actual;   // host view when the guest stats were last fresh
+    char uuid_str[VIR_UUID_STRING_BUFLEN];
+    char tag[MAX_VM_NAME_LENGTH];       // from the domain's balloon metadata, may be empty
+    const balloon_config *config;       // effective policy, resolved on insert and reload
+    vm_info vm;                         // this sweep's sample, zero if there is nothing to do
+    long int decided;                   // this sweep's controller output, before the arbiter
+    long int target;                    // this sweep's balloon size, in KB
+    int held;                           // no decision this sweep, the last resize was still moving
+    controller_state ctrl;
+    rail_state rails;
+    long int pending;                   // balloon size of the resize in flight, 0 if none
+    long int pending_from;              // balloon size when it was queued
+    double pending_since;
+    unsigned long resize_seq;           // last queued resize
+    unsigned long resize_failed;        // set to resize_seq by the dispatcher on failure
+    unsigned int trace_id;              // run-local number in the trace, 0 until first traced
+    unsigned int trace_generation;      // settings_generation of the last traced config
+    unsigned int seen;                  // last sweep the domain was listed in
+} vm_entry;
+
+typedef struct {
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    int slot;
+    unsigned int generation;    // of the slot when queued, see dispatch_dom
+    unsigned long seq;
+    long int target;
+} resize_request;
+
+/* what a restart needs to go on where the last run stopped, one per VM */
+typedef struct {
+    unsigned char uuid[VIR_UUID_BUFLEN];    // first, the sort and search key
+    controller_state ctrl;
+    long int sample_period;
+    long int last_update;
+    float last_used, distress;
+    long int pending, pending_from;         // resize in flight, 0 if none
+    double pending_age;                     // ms it had been moving
+    rail_state rails;                       // times as ms before the checkpoint
+} checkpoint_record;
+
+enum { TRACE_START = 1, TRACE_VM, TRACE_CONFIG, TRACE_TICK, TRACE_STATE };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    char reserved[48];
+} trace_header;
+
+typedef struct {            // what a controller reads from balloon_config
+    float low_threshold, high_threshold, target_pressure;
+    float kp, ki, kd, forecast_alpha, forecast_beta;
+    int32_t speed, max_step, forecast_horizon, min_memory, max_memory;
+    uint8_t controller;     // index in controllers[]
+    int8_t priority;
+} trace_config;
+
+typedef struct {
+    uint8_t kind;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t vm;            // run-local VM number, from its TRACE_VM record
+    union {
+        struct {            // in KB, ts in ms since the epoch
+            int64_t ts, actual, available, max, decided, target;
+            uint32_t last_update;
+            float distress;
+        } tick;
+        struct {
+            unsigned char uuid[VIR_UUID_BUFLEN];
+            char name[40];
+        } domain;
+        trace_config config;
+        struct {            // bytes of the controller_state a VM starts from
+            uint32_t offset;
+            unsigned char bytes[52];
+        } state;
+    };
+} trace_record;
+
+_Static_assert(sizeof(trace_header) == 64 && sizeof(trace_record) == 64, "trace layout changed");
+
+/*
+ * Everything the daemon asks of a hypervisor, picked by URI. Connections and
+ * domains are opaque handles; a domain returned by lookup or sample_all is
+ * owned by the caller until release. Calls that are round trips go through RPC().
+ */
+typedef struct {
+    const char *name;
+    const char *prefix;                 // URIs this backend serves
+    void *(*open)(const char *uri);
+    void (*close)(void *conn);
+    int (*list)(void *conn, int *ids, int max);                 // IDs of the running domains
+    void *(*lookup_id)(void *conn, int id);
+    void *(*lookup_uuid)(void *conn, const unsigned char *uuid);
+    void (*release)(void *dom);
+    int (*get_uuid)(void *dom, unsigned char *uuid);            // never a round trip
+    int (*get_id)(void *dom);                                   // never a round trip
+    int (*describe)(void *dom, vm_entry *e);                    // uuid, id, name, max and tag
+    int (*sample)(void *dom, vm_info *vm);                      // everything but max
+    int (*sample_all)(void *conn, void **doms, vm_info *vms, int max);
+    int (*set_period)(void *dom, long int period);
+    int (*set_memory)(void *dom, long int kb);
+    void (*advance)(long int ms);       // simulated time only, NULL means sleep
+    double (*clock_ms)(void);           // NULL means now_ms()
+    void (*report)(FILE *out);          // optional, printed after --bench
+} balloon_backend;
+
+typedef struct {
+    pthread_mutex_t lock;               // balloon position, against the dispatcher
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    char name[MAX_VM_NAME_LENGTH];
+    unsigned long seed;
+    long int max, base, wave, phase;    // demand curve, in KB and seconds
+    long int cache;                     // page cache the guest rereads, in KB
+    double swap_in, faults;             // guest counters, in KB and faults
+    long int actual, target;            // balloon, in KB
+    double moving_at;                   // simulated ms the balloon starts moving to target
+    long int period;                    // stats push period the daemon set, in seconds
+    int direction;                      // of the last resize, to count reversals
+    double resized_at;
+} sim_vm;
+
+typedef struct {
+    pthread_t thread;
+    void *connection;
+    int index;
+} balloon_worker;
+
+enum { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG };
+enum { LOG_KIND_TEXT, LOG_KIND_TICK };
+
+typedef struct {
+    int kind;
+    int level;
+    struct timespec ts;
+    union {
+        char text[LOG_TEXT_LENGTH];
+        struct {
+            char name[MAX_VM_NAME_LENGTH];
+            vm_info vm;
+            long int target;
+        } tick;
+    };
+} log_record;
+
+typedef struct {
+    unsigned long seq;      // ring position this cell is ready for, Vyukov style
+    log_record rec;
+} log_cell;
+
+typedef struct {
+    unsigned long buckets[HISTOGRAM_BUCKETS];
+    unsigned long count;
+    unsigned long sum_ns;
+} histogram;
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+    int failed;             // a write did not fit and could not grow the buffer, the text is cut short
+} metrics_buffer;
+
+/* process-wide, so they never go down when a domain leaves the cache */
+typedef struct {
+    unsigned long inflates, deflates;   // resizes that landed
+    unsigned long inflate_kb, deflate_kb;
+    unsigned long resize_timeouts, resize_failures;
+    unsigned long thrashes;             // resizes that reversed the last one within THRASH_WINDOW
+} metrics_counters;
+
+typedef struct {
+    const char *expr;       // the call expression, as written at the site
+    const char *where;      // calling function
+    int registered;
+    unsigned long count, total_ns, max_ns;
+    unsigned long buckets[PROFILE_BUCKETS];
+} rpc_site;
+
+/* count and time every call that is a round trip to libvirtd, per call site */
+#define RPC(call) ({                                                \
+    static rpc_site _rpc_site = { .expr = #call, .where = __func__ }; \
+    unsigned long _rpc_start = now_ns();                            \
+    __typeof__(call) _rpc_ret = (call);                             \
+    rpc_done(&_rpc_site, now_ns() - _rpc_start);                    \
+    _rpc_ret;                                                       \
+})
+
+const balloon_backend *backend = NULL;
+void *connection = NULL;
+unsigned long rpc_count = 0;
+int bulk_stats = 0;
+
+/* async logging, see the Logging section */
+log_cell log_ring[LOG_RING_SIZE];
+unsigned long log_head = 0, log_tail = 0, log_dropped = 0;
+int log_wake_fd = -1, log_sleeping = 0;     // eventfd a producer writes when the writer sleeps
+long int log_window[LOG_DEBUG + 1], log_window_count[LOG_DEBUG + 1];
+int log_level = LOG_INFO;
+FILE *log_out = NULL;
+const char *log_level_names[] = { "error", "warn", "info", "debug" };
+
+/* metrics, see the Metrics sections */
+histogram sweep_histogram, rpc_histogram;
+int metrics_enabled = 0;
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+metrics_buffer metrics_front, metrics_back;
+metrics_counters counters;              // bumped from the sweep workers, atomically
+
+/* --profile, see the Profiling section */
+int profiling = 0;
+rpc_site *rpc_sites[MAX_RPC_SITES];
+int num_rpc_sites = 0;
+
+/* worker pool state, shared with the main loop for the duration of a sweep */
+balloon_worker workers[MAX_NUM_OF_WORKER];
+int num_workers = 0;
+pthread_barrier_t sweep_start, sweep_done;
+int sweep_vm_ids[MAX_NUM_OF_VM];
+void *sweep_doms[MAX_NUM_OF_VM];
+vm_info sweep_samples[MAX_NUM_OF_VM];
+int sweep_num_VMs = 0;
+balloon_settings settings;
+
+/* sampling schedule, see the Scheduler section; main thread only */
+int schedule_heap[MAX_NUM_OF_VM];
+int schedule_len = 0;
+int sweep_due[MAX_NUM_OF_VM];
+unsigned long samples_taken = 0;
+
+/* domain cache, only changed between sweeps or from the event loop thread */
+vm_entry vm_cache[MAX_NUM_OF_VM];
+int index_by_uuid[VM_CACHE_BUCKETS];
+int index_by_id[VM_CACHE_BUCKETS];
+int vm_cache_count = 0;
+unsigned int sweep_generation = 0;
+
+enum { PHASE_DECIDE, PHASE_APPLY };
+int sweep_phase = PHASE_DECIDE;
+
+/* --trace, see the Trace section */
+int trace_fd = -1;
+trace_record trace_buffer[TRACE_BUFFER];
+int trace_len = 0;
+unsigned int trace_num_vms = 0;
+unsigned int settings_generation = 1;   // bumped by every config reload
+
+/* resize dispatch queue, see the Resize Dispatch section; never holds more than one request per VM */
+resize_request resize_queue[MAX_NUM_OF_VM];
+unsigned long resize_head = 0, resize_tail = 0, resize_seq = 0;
+pthread_mutex_t resize_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t resize_cond = PTHREAD_COND_INITIALIZER;
+void *dispatch_connection = NULL;
+int resize_busy = 0;
+unsigned int slot_generation[MAX_NUM_OF_VM];    // bumped when a slot's domain leaves or restarts
+void *dispatch_doms[MAX_NUM_OF_VM];             // dispatcher only: handles on its connection
+unsigned int dispatch_generation[MAX_NUM_OF_VM];
+pthread_cond_t resize_idle = PTHREAD_COND_INITIALIZER;
+
+/* simulator state, see the Simulator section */
+sim_vm sim_vms[MAX_NUM_OF_VM];
+int sim_num_vms = 0;
+double sim_now = 0;
+pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+struct {
+    double seconds, pressure_seconds, starved_seconds;     // summed over VMs
+    double held, pushes;
+    double reclaimed, swap_in, faults;  // in KB-seconds, KB and faults
+    double resizes, reversals;          // reversals: resizes undoing the last one within THRASH_WINDOW
+} sim_stats;
+
+int event_mode = 0;
+const char *host_mem_file = NULL;
+int tick_timer = -1;
+
+/* daemon lifecycle, see the Daemon section */
+int stopping = 0;                       // set once by SIGTERM or SIGINT
+int wake_fd = -1;                       // eventfd that cuts the wait between sweeps short
+const char *checkpoint_path = NULL;
+checkpoint_record *restored = NULL;     // the loaded checkpoint, sorted by uuid
+int num_restored = 0, num_resumed = 0;
+unsigned long start_ns = 0, first_decision_ns = 0, decisions = 0;
+
+/* share of max in use, pushed towards 1 while the guest swaps or faults */
+float vm_pressure(const vm_info *vm) {
+    float pressure = (float)(vm->max - vm->available) / vm->max;
+    return pressure + vm->distress * (1 - pressure);
+}
+
+// ******************** Logging ********************
+/*
+ * Producers (control loop, workers, watcher) only fill a fixed-size record in
+ * a bounded lock-free MPMC ring (Vyukov); a writer thread formats and writes
+ * them. Tick records stay binary until the writer turns them into JSON lines.
+ * A full ring drops the record instead of blocking the control loop. An idle
+ * writer sleeps on an eventfd; the producer that finds it asleep wakes it.
+ */
+void log_init() {
+    unsigned long i;
+    for (i = 0; i < LOG_RING_SIZE; i++)
+        log_ring[i].seq = i;
+    log_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+/* claim a cell or return NULL if the writer is LOG_RING_SIZE records behind */
+log_cell *log_claim(unsigned long *pos_out) {
+    unsigned long pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED), seq;
+    log_cell *cell;
+    long diff;
+
+    for (;;) {
+        cell = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+        }
+    }
+    *pos_out = pos;
+    return cell;
+}
+
+/* a full counter fails the write, the writer has not read it yet and is awake anyway */
+void log_wake() {
+    uint64_t one = 1;
+    if (write(log_wake_fd, &one, sizeof(one)) < 0) return;
+}
+
+void log_publish(log_cell *cell, unsigned long pos) {
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    /* pairs with the fence in log_writer: either it sees this record or we see it asleep */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&log_sleeping, 0, __ATOMIC_RELAXED))
+        log_wake();
+}
+
+/* at most LOG_RATE_LIMIT text messages per level per second, the rest are counted */
+int log_rate_limited(int level) {
+    long int now = time(NULL);
+    if (__atomic_load_n(&log_window[level], __ATOMIC_RELAXED) != now) {
+        __atomic_store_n(&log_window[level], now, __ATOMIC_RELAXED);
+        __atomic_store_n(&log_window_count[level], 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&log_window_count[level], 1, __ATOMIC_RELAXED) <= LOG_RATE_LIMIT)
+        return 0;
+    __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void vlog_msg(int level, const char *format, va_list args) {
+    unsigned long pos;
+    log_cell *cell;
+
+    if (level > log_level || log_rate_limited(level)) return;
+    if (!(cell = log_claim(&pos))) return;
+    cell->rec.kind = LOG_KIND_TEXT;
+    cell->rec.level = level;
+    clock_gettime(CLOCK_REALTIME, &cell->rec.ts);
+    vsnprintf(cell->rec.text, sizeof(cell->rec.text), format, args);
+    log_publish(cell, pos);
+}
+
+void log_msg(int level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vlog_msg(level, format, args);
+    va_end(args);
+}
 
 void err_log(const char *format, ...) {
-    FILE *f = fopen(ERROR_LOG_FILE, "a+");
-    if (f != NULL) {
-        va_list args;
-        va_start(args, format);
-        vfprintf(f, format, args);
-        va_end(args);
-        fclose(f);
+    va_list args;
+    va_start(args, format);
+    vlog_msg(LOG_ERROR, format, args);
+    va_end(args);
+}
+
+/* one per VM per tick, no formatting on the caller's side */
+void log_tick(const char *name, const vm_info *vm, long int target) {
+    unsigned long pos;
+    log_cell *cell;
+    size_t len;
+
+    if (LOG_INFO > log_level) return;
+    if (!(cell = log_claim(&pos))) return;
+    cell->rec.kind = LOG_KIND_TICK;
+    cell->rec.level = LOG_INFO;
+    clock_gettime(CLOCK_REALTIME, &cell->rec.ts);
+    len = strnlen(name, sizeof(cell->rec.tick.name) - 1);
+    memcpy(cell->rec.tick.name, name, len);
+    cell->rec.tick.name[len] = '\0';
+    cell->rec.tick.vm = *vm;
+    cell->rec.tick.target = target;
+    log_publish(cell, pos);
+}
+
+/*
+ * A quoted value for the JSON log and the OpenMetrics labels: backslash, double
+ * quote and newline are escaped, other control characters become '?'.
+ */
+const char *escape_quoted(char *out, size_t size, const char *value) {
+    size_t n = 0;
+
+    for (; *value && n + 2 < size; value++) {
+        if (*value == '\\' || *value == '"' || *value == '\n')
+            out[n++] = '\\';
+        out[n++] = *value == '\n' ? 'n' : (unsigned char)*value < ' ' ? '?' : *value;
+    }
+    out[n] = '\0';
+    return out;
+}
+
+void log_write(const log_record *rec, FILE *out, FILE *err) {
+    const vm_info *vm = &rec->tick.vm;
+    double ts = rec->ts.tv_sec + rec->ts.tv_nsec / 1e9;
+    char name[2 * MAX_VM_NAME_LENGTH];
+
+    if (rec->kind == LOG_KIND_TICK) {
+        fprintf(out, "{\"ts\":%.3f,\"vm\":\"%s\",\"actual\":%ld,\"available\":%ld,\"max\":%ld,"
+            "\"pressure\":%.4f,\"distress\":%.3f,\"target\":%ld}\n", ts,
+            escape_quoted(name, sizeof(name), rec->tick.name),
+            vm->actual, vm->available, vm->max, vm_pressure(vm), vm->distress, rec->tick.target);
+    } else if (rec->level <= LOG_WARN && err) {
+        fprintf(err, "%.3f %s %s", ts, log_level_names[rec->level], rec->text);
+    } else {
+        fprintf(out, "%s", rec->text);
+    }
+}
+
+void *log_writer(void *data) {
+    FILE *err = fopen(ERROR_LOG_FILE, "a");
+    struct pollfd wake = { .fd = log_wake_fd, .events = POLLIN };
+    unsigned long pos, dropped;
+    uint64_t count;
+    log_cell *cell;
+    FILE *out;
+
+    for (;;) {
+        out = __atomic_load_n(&log_out, __ATOMIC_ACQUIRE);
+        pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+        cell = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+            /* idle: push out what is buffered and sleep until a producer wakes us, they never wait on us */
+            if ((dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED)))
+                fprintf(err ? err : out, "dropped %lu log records\n", dropped);
+            fflush(out);
+            if (err) fflush(err);
+            __atomic_store_n(&log_sleeping, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&cell->seq, __ATOMIC_RELAXED) != pos + 1)
+                poll(&wake, log_wake_fd >= 0, log_wake_fd >= 0 ? LOG_FLUSH_MS : LOG_IDLE_US / 1000);
+            __atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+            if (log_wake_fd >= 0 && read(log_wake_fd, &count, sizeof(count)) < 0)
+                count = 0;      // not signalled: a timeout, or the record was seen before sleeping
+            continue;
+        }
+        log_write(&cell->rec, out, err);
+        __atomic_store_n(&cell->seq, pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&log_tail, pos + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int start_log_writer() {
+    pthread_t thread;
+    __atomic_store_n(&log_out, stdout, __ATOMIC_RELEASE);
+    if (pthread_create(&thread, NULL, log_writer, NULL)) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+/* wait (bounded) until the writer has caught up and flushed */
+void log_flush() {
+    int i;
+    for (i = 0; i < 100; i++) {
+        if (__atomic_load_n(&log_tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&log_head, __ATOMIC_RELAXED))
+            break;
+        usleep(LOG_IDLE_US);
+    }
+    usleep(2 * LOG_IDLE_US);
+}
+// ******************** End Logging ********************
+
+double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// ******************** Metrics ********************
+/* upper bounds in seconds, the last bucket is +Inf */
+const double histogram_bounds[HISTOGRAM_BUCKETS - 1] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5
+};
+
+/* lock-free, any thread may observe */
+void histogram_observe(histogram *h, double ms) {
+    int i;
+    for (i = 0; i < HISTOGRAM_BUCKETS - 1 && ms / 1000 > histogram_bounds[i]; i++);
+    __atomic_add_fetch(&h->buckets[i], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum_ns, (unsigned long)(ms * 1e6), __ATOMIC_RELAXED);
+}
+// ******************** End Metrics ********************
+
+// ******************** Profiling ********************
+/*
+ * With --profile every RPC() call site gets its own log-linear histogram:
+ * PROFILE_SUB_BUCKETS linear buckets per power of two of nanoseconds, which
+ * bounds the error to 1/16 of the value in fixed memory. Sites register
+ * themselves on first use; the RPC() macro keeps a static rpc_site per expansion.
+ */
+unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+int profile_index(unsigned long ns) {
+    int k;
+    if (ns < PROFILE_SUB_BUCKETS) return ns;
+    k = 63 - __builtin_clzl(ns);
+    if (k > PROFILE_MAX_POWER) return PROFILE_BUCKETS - 1;
+    return (k - 3) * PROFILE_SUB_BUCKETS + ((ns >> (k - 4)) & (PROFILE_SUB_BUCKETS - 1));
+}
+
+/* the largest value that lands in bucket i */
+unsigned long profile_value(int i) {
+    int k = i / PROFILE_SUB_BUCKETS + 3, sub = i % PROFILE_SUB_BUCKETS;
+    if (i < PROFILE_SUB_BUCKETS) return i;
+    return ((unsigned long)(PROFILE_SUB_BUCKETS + sub + 1) << (k - 4)) - 1;
+}
+
+void profile_record(rpc_site *site, unsigned long ns) {
+    unsigned long max = __atomic_load_n(&site->max_ns, __ATOMIC_RELAXED);
+    int expected = 0, n;
+
+    if (__atomic_compare_exchange_n(&site->registered, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        n = __atomic_fetch_add(&num_rpc_sites, 1, __ATOMIC_ACQ_REL);
+        if (n < MAX_RPC_SITES)
+            __atomic_store_n(&rpc_sites[n], site, __ATOMIC_RELEASE);
+    }
+    __atomic_add_fetch(&site->buckets[profile_index(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->total_ns, ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&site->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void rpc_done(rpc_site *site, unsigned long ns) {
+    __atomic_add_fetch(&rpc_count, 1, __ATOMIC_RELAXED);
+    histogram_observe(&rpc_histogram, ns / 1e6);
+    if (profiling) profile_record(site, ns);
+}
+
+unsigned long profile_percentile(const rpc_site *site, unsigned long count, double p) {
+    unsigned long rank = (unsigned long)(count * p), seen = 0;
+    int i;
+    for (i = 0; i < PROFILE_BUCKETS; i++) {
+        seen += __atomic_load_n(&site->buckets[i], __ATOMIC_RELAXED);
+        if (seen > rank) return MIN(profile_value(i), site->max_ns);
+    }
+    return site->max_ns;
+}
+
+/* cost of the two clock reads RPC() adds around a call */
+double profile_overhead_ns() {
+    unsigned long start = now_ns();
+    int i;
+    for (i = 0; i < 10000; i++)
+        now_ns();
+    return (now_ns() - start) * 2.0 / 10000;
+}
+
+void profile_dump() {
+    unsigned long count, calls = 0, rpc_ns = 0, sweep_ns = __atomic_load_n(&sweep_histogram.sum_ns, __ATOMIC_RELAXED);
+    int i, n = MIN(__atomic_load_n(&num_rpc_sites, __ATOMIC_ACQUIRE), MAX_RPC_SITES);
+    rpc_site *site;
+
+    fprintf(stderr, "%-30s %-18s %9s %10s %10s %10s\n", "call", "site", "calls", "p50(us)", "p99(us)", "max(us)");
+    for (i = 0; i < n; i++) {
+        if (!(site = __atomic_load_n(&rpc_sites[i], __ATOMIC_ACQUIRE))) continue;
+        count = __atomic_load_n(&site->count, __ATOMIC_RELAXED);
+        calls += count;
+        rpc_ns += site->total_ns;
+        fprintf(stderr, "%-30.*s %-18s %9lu %10.1f %10.1f %10.1f\n",
+            (int)strcspn(site->expr, "("), site->expr, site->where, count,
+            profile_percentile(site, count, 0.5) / 1e3, profile_percentile(site, count, 0.99) / 1e3,
+            site->max_ns / 1e3);
     }
+    /* --bench does not go through sweep(), charge the overhead to the calls themselves */
+    if (sweep_ns || rpc_ns)
+        fprintf(stderr, "timing overhead: %.3f%% of %.1fms spent in %s\n",
+            calls * profile_overhead_ns() * 100 / (sweep_ns ? sweep_ns : rpc_ns),
+            (sweep_ns ? sweep_ns : rpc_ns) / 1e6, sweep_ns ? "sweeps" : "libvirt calls");
 }
+// ******************** End Profiling ********************
 
 void generate_default_config_file() {
     FILE *file = fopen(CONFIG_FILE, "w");
@@ -57,113 +846,2928 @@ void generate_default_config_file() {
     fprintf(file, "low_threshold=%f\n", CONFIG_LOW_THRESHOLD_DEFAULT);
     fprintf(file, "high_threshold=%f\n", CONFIG_HIGH_THRESHOLD_DEFAULT);
     fprintf(file, "interval=%ld\n", CONFIG_INTERVAL_DEFAULT);
-    fprintf(file, "speed=%ld", CONFIG_SPEED_DEFAULT);
+    fprintf(file, "speed=%ld\n", CONFIG_SPEED_DEFAULT);
+    fprintf(file, "controller=%s\n", CONFIG_CONTROLLER_DEFAULT);
+    fprintf(file, "target_pressure=%f\n", CONFIG_TARGET_PRESSURE_DEFAULT);
+    fprintf(file, "kp=%f\n", CONFIG_KP_DEFAULT);
+    fprintf(file, "ki=%f\n", CONFIG_KI_DEFAULT);
+    fprintf(file, "kd=%f\n", CONFIG_KD_DEFAULT);
+    fprintf(file, "max_step=%ld\n", CONFIG_MAX_STEP_DEFAULT);
+    fprintf(file, "forecast_alpha=%f\n", CONFIG_FORECAST_ALPHA_DEFAULT);
+    fprintf(file, "forecast_beta=%f\n", CONFIG_FORECAST_BETA_DEFAULT);
+    fprintf(file, "forecast_horizon=%d\n", CONFIG_FORECAST_HORIZON_DEFAULT);
+    fprintf(file, "host_min_free=%ld\n", CONFIG_HOST_MIN_FREE_DEFAULT);
+    fprintf(file, "resize_timeout=%ld\n", CONFIG_RESIZE_TIMEOUT_DEFAULT);
+    fprintf(file, "min_interval=%ld\n", CONFIG_MIN_INTERVAL_DEFAULT);
+    fprintf(file, "max_interval=%ld\n", CONFIG_MAX_INTERVAL_DEFAULT);
+    fprintf(file, "swap_in_limit=%ld\n", CONFIG_SWAP_IN_LIMIT_DEFAULT);
+    fprintf(file, "fault_limit=%ld\n", CONFIG_FAULT_LIMIT_DEFAULT);
+    fprintf(file, "psi_limit=%f\n", CONFIG_PSI_LIMIT_DEFAULT);
+    fprintf(file, "min_memory_share=%f\n", CONFIG_MIN_MEMORY_SHARE_DEFAULT);
+    fprintf(file, "rate_limit=%ld\n", CONFIG_RATE_LIMIT_DEFAULT);
+    fprintf(file, "cooldown=%ld", CONFIG_COOLDOWN_DEFAULT);
     fclose(file);
 }
 
+int make_dir(const char *path) {
+    if (mkdir(path, 0755) == 0 || errno == EEXIST) return 0;
+    err_log("[%s] Can not create %s: %s\n", __func__, path, strerror(errno));
+    return -1;
+}
+
+/* the config file is only written when there is none, never over the admin's */
 int create_file_if_not_exist() {
-    int status = 0;
-    status = system("mkdir -p /etc/balloon");
-    status = system("mkdir -p /var/log/balloon");
-    generate_default_config_file();
+    int status = make_dir(CONFIG_DIR) | make_dir(LOG_DIR);
+    if (access(CONFIG_FILE, F_OK) < 0)
+        generate_default_config_file();
     return status;
 }
 
-void read_config(balloon_config *config) {
-    char config_buffer[256];
+// ******************** Controllers ********************
+/* the original bang-bang policy: fixed steps outside [low, high), deflating faster under distress */
+long int threshold_decide(controller_state *state, const vm_info *vm, const balloon_config *config) {
+    float pressure = vm_pressure(vm);
+    if (pressure < config->low_threshold)
+        return vm->actual - config->speed;
+    if (pressure >= config->high_threshold)
+        return vm->actual + (long int)(2*config->speed * (1 + DISTRESS_BOOST * vm->distress));
+    return vm->actual;
+}
+
+/*
+ * PID on the pressure error. Growing the balloon target by x KB frees about
+ * x KB in the guest, so a step of error * max lands on target_pressure in one
+ * tick at kp = 1; lower gains converge geometrically without overshoot.
+ */
+long int pid_decide(controller_state *state, const vm_info *vm, const balloon_config *config) {
+    double error = vm_pressure(vm) - config->target_pressure;
+    double derivative = state->primed ? error - state->prev_error : 0;
+    double limit = (double)config->max_step / vm->max;
+    double out;
+
+    state->integral += error;
+    /* anti-windup: the integral alone may never ask for more than one full step */
+    if (config->ki > 0 && fabs(state->integral * config->ki) > limit)
+        state->integral = copysign(limit / config->ki, state->integral);
+    state->prev_error = error;
+    state->primed = 1;
+
+    out = (config->kp * error + config->ki * state->integral + config->kd * derivative) * vm->max;
+    if (out > config->max_step) out = config->max_step;
+    if (out < -config->max_step) out = -config->max_step;
+    /* ignore steps below the 1MB the guest driver bothers to move */
+    if (fabs(out) < 1024) return vm->actual;
+    return vm->actual + (long int)out;
+}
+
+void push_sample(controller_state *state, const vm_info *vm) {
+    vm_sample *sample = &state->samples[(state->head + state->num_samples) % FORECAST_WINDOW];
+    sample->actual = vm->actual;
+    sample->available = vm->available;
+    if (state->num_samples < FORECAST_WINDOW)
+        state->num_samples++;
+    else
+        state->head = (state->head + 1) % FORECAST_WINDOW;
+}
+
+/*
+ * Holt linear trend on used memory (actual - available), which unlike
+ * available does not move when we resize the balloon. The first full window
+ * seeds level and trend with a least-squares fit. Returns 0 until then.
+ */
+int forecast_used(controller_state *state, const vm_info *vm, const balloon_config *config, double *used) {
+    double u = vm->actual - vm->available, prev_level, x, y, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    int i, n;
+
+    push_sample(state, vm);
+    if (!state->primed) {
+        if (state->num_samples < FORECAST_WINDOW) return 0;
+        n = state->num_samples;
+        for (i = 0; i < n; i++) {
+            const vm_sample *sample = &state->samples[(state->head + i) % FORECAST_WINDOW];
+            x = i;
+            y = sample->actual - sample->available;
+            sx += x; sy += y; sxx += x * x; sxy += x * y;
+        }
+        state->trend = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+        state->level = sy / n + state->trend * (n - 1 - sx / n);
+        state->primed = 1;
+    } else {
+        prev_level = state->level;
+        state->level = config->forecast_alpha * u
+            + (1 - config->forecast_alpha) * (state->level + state->trend);
+        state->trend = config->forecast_beta * (state->level - prev_level)
+            + (1 - config->forecast_beta) * state->trend;
+    }
+    *used = state->level + config->forecast_horizon * state->trend;
+    return 1;
+}
+
+/*
+ * The threshold policy applied to whichever is worse, the current sample or
+ * the forecast, so deflation starts before the breach and inflation never
+ * takes memory a rising guest is about to need.
+ */
+long int predictive_decide(controller_state *state, const vm_info *vm, const balloon_config *config) {
+    vm_info predicted = *vm;
+    double used;
+
+    if (forecast_used(state, vm, config, &used)) {
+        predicted.available = MAX(vm->actual - (long int)used, 0);
+        if (predicted.available < vm->available)
+            return threshold_decide(state, &predicted, config);
+    }
+    return threshold_decide(state, vm, config);
+}
+
+const balloon_controller controllers[] = {
+    { "threshold",  threshold_decide },
+    { "pid",        pid_decide },
+    { "predictive", predictive_decide },
+};
+
+const balloon_controller *find_controller(const char *name) {
+    size_t i;
+    for (i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++)
+        if (!strcmp(controllers[i].name, name)) return &controllers[i];
+    return NULL;
+}
+// ******************** End Controllers ********************
+
+void default_config(balloon_config *config) {
+    config->low_threshold = CONFIG_LOW_THRESHOLD_DEFAULT;
+    config->high_threshold = CONFIG_HIGH_THRESHOLD_DEFAULT;
+    config->interval = CONFIG_INTERVAL_DEFAULT;
+    config->speed = CONFIG_SPEED_DEFAULT;
+    config->controller = find_controller(CONFIG_CONTROLLER_DEFAULT);
+    config->target_pressure = CONFIG_TARGET_PRESSURE_DEFAULT;
+    config->kp = CONFIG_KP_DEFAULT;
+    config->ki = CONFIG_KI_DEFAULT;
+    config->kd = CONFIG_KD_DEFAULT;
+    config->max_step = CONFIG_MAX_STEP_DEFAULT;
+    config->forecast_alpha = CONFIG_FORECAST_ALPHA_DEFAULT;
+    config->forecast_beta = CONFIG_FORECAST_BETA_DEFAULT;
+    config->forecast_horizon = CONFIG_FORECAST_HORIZON_DEFAULT;
+    config->host_min_free = CONFIG_HOST_MIN_FREE_DEFAULT;
+    config->min_memory = 0;
+    config->max_memory = 0;
+    config->priority = PRIORITY_NORMAL;
+    config->resize_timeout = CONFIG_RESIZE_TIMEOUT_DEFAULT;
+    config->min_interval = CONFIG_MIN_INTERVAL_DEFAULT;
+    config->max_interval = CONFIG_MAX_INTERVAL_DEFAULT;
+    config->swap_in_limit = CONFIG_SWAP_IN_LIMIT_DEFAULT;
+    config->fault_limit = CONFIG_FAULT_LIMIT_DEFAULT;
+    config->psi_limit = CONFIG_PSI_LIMIT_DEFAULT;
+    config->min_memory_share = CONFIG_MIN_MEMORY_SHARE_DEFAULT;
+    config->rate_limit = CONFIG_RATE_LIMIT_DEFAULT;
+    config->cooldown = CONFIG_COOLDOWN_DEFAULT;
+}
+
+/* a name or a number, anything else is INT_MIN so validate_config rejects it */
+int parse_priority(const char *value) {
+    char *end;
+    long int n;
+
+    if (!strcmp(value, "batch"))    return PRIORITY_BATCH;
+    if (!strcmp(value, "normal"))   return PRIORITY_NORMAL;
+    if (!strcmp(value, "high"))     return PRIORITY_HIGH;
+    if (!strcmp(value, "critical")) return PRIORITY_CRITICAL;
+    n = strtol(value, &end, 10);
+    return end == value || *end || n != (int)n ? INT_MIN : (int)n;
+}
+
+/* one key=value pair, keys missing from the file keep their default */
+int set_config_value(balloon_config *config, const char *key, const char *value) {
+    if (!strcmp(key, "low_threshold"))        config->low_threshold = atof(value);
+    else if (!strcmp(key, "high_threshold"))  config->high_threshold = atof(value);
+    else if (!strcmp(key, "interval"))        config->interval = atol(value);
+    else if (!strcmp(key, "speed"))           config->speed = atol(value);
+    else if (!strcmp(key, "target_pressure")) config->target_pressure = atof(value);
+    else if (!strcmp(key, "kp"))              config->kp = atof(value);
+    else if (!strcmp(key, "ki"))              config->ki = atof(value);
+    else if (!strcmp(key, "kd"))              config->kd = atof(value);
+    else if (!strcmp(key, "max_step"))        config->max_step = atol(value);
+    else if (!strcmp(key, "forecast_alpha"))  config->forecast_alpha = atof(value);
+    else if (!strcmp(key, "forecast_beta"))   config->forecast_beta = atof(value);
+    else if (!strcmp(key, "forecast_horizon")) config->forecast_horizon = atol(value);
+    else if (!strcmp(key, "host_min_free"))   config->host_min_free = atol(value);
+    else if (!strcmp(key, "min_memory"))      config->min_memory = atol(value);
+    else if (!strcmp(key, "max_memory"))      config->max_memory = atol(value);
+    else if (!strcmp(key, "priority"))        config->priority = parse_priority(value);
+    else if (!strcmp(key, "resize_timeout"))  config->resize_timeout = atol(value);
+    else if (!strcmp(key, "min_interval"))    config->min_interval = atol(value);
+    else if (!strcmp(key, "max_interval"))    config->max_interval = atol(value);
+    else if (!strcmp(key, "swap_in_limit"))   config->swap_in_limit = atol(value);
+    else if (!strcmp(key, "fault_limit"))     config->fault_limit = atol(value);
+    else if (!strcmp(key, "psi_limit"))       config->psi_limit = atof(value);
+    else if (!strcmp(key, "min_memory_share")) config->min_memory_share = atof(value);
+    else if (!strcmp(key, "rate_limit"))      config->rate_limit = atol(value);
+    else if (!strcmp(key, "cooldown"))        config->cooldown = atol(value);
+    else if (!strcmp(key, "controller")) {
+        if (!(config->controller = find_controller(value))) return -1;
+    }
+    else return -1;
+    return 0;
+}
+
+int validate_config(const balloon_config *config) {
+    return config->low_threshold > 0 && config->low_threshold < config->high_threshold
+        && config->high_threshold <= 1 && config->interval > 0 && config->speed > 0
+        && config->controller && config->target_pressure > 0 && config->target_pressure < 1
+        && config->max_step > 0 && config->forecast_alpha > 0 && config->forecast_alpha <= 1
+        && config->forecast_beta > 0 && config->forecast_beta <= 1
+        && config->forecast_horizon >= 0 && config->host_min_free >= 0 && config->min_memory >= 0
+        && (!config->max_memory || config->max_memory >= config->min_memory)
+        && config->resize_timeout > 0 && config->min_interval > 0
+        && config->max_interval >= config->min_interval
+        && config->swap_in_limit >= 0 && config->fault_limit >= 0 && config->psi_limit >= 0
+        && config->min_memory_share >= 0 && config->min_memory_share < 1
+        && config->rate_limit >= 0 && config->cooldown >= 0
+        && config->priority >= INT8_MIN && config->priority <= INT8_MAX ? 0 : -1;    // an int8_t in the trace
+}
+
+// ******************** Policy Table ********************
+/* FNV-1a over "kind:key", so the three match kinds share one index */
+unsigned int hash_policy(int match, const char *key) {
+    unsigned int h = 2166136261u ^ match;
+    for (; *key; key++)
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    return h & (POLICY_BUCKETS - 1);
+}
+
+const vm_policy *find_policy(const balloon_settings *settings, int match, const char *key) {
+    unsigned int h = hash_policy(match, key);
+    int i;
+    for (; (i = settings->index[h]) >= 0; h = (h + 1) & (POLICY_BUCKETS - 1))
+        if (settings->policies[i].match == match && !strcmp(settings->policies[i].key, key))
+            return &settings->policies[i];
+    return NULL;
+}
+
+/* a [vm:NAME], [uuid:UUID] or [tag:TAG] section header */
+vm_policy *add_policy(balloon_settings *settings, const char *kind, const char *key) {
+    vm_policy *policy;
+    unsigned int h;
+    int match;
+
+    if (!strcmp(kind, "vm"))        match = POLICY_MATCH_NAME;
+    else if (!strcmp(kind, "uuid")) match = POLICY_MATCH_UUID;
+    else if (!strcmp(kind, "tag"))  match = POLICY_MATCH_TAG;
+    else return NULL;
+    if (settings->num_policies == MAX_NUM_OF_POLICY || find_policy(settings, match, key))
+        return NULL;
+
+    policy = &settings->policies[settings->num_policies];
+    policy->match = match;
+    snprintf(policy->key, sizeof(policy->key), "%s", key);
+    policy->config = settings->global;
+
+    for (h = hash_policy(match, key); settings->index[h] >= 0; h = (h + 1) & (POLICY_BUCKETS - 1));
+    settings->index[h] = settings->num_policies++;
+    return policy;
+}
+
+/* name wins over UUID, UUID over tag, anything over the global section */
+const balloon_config *resolve_policy(const balloon_settings *settings, const char *name,
+                                     const char *uuid, const char *tag) {
+    const vm_policy *policy;
+    if ((policy = find_policy(settings, POLICY_MATCH_NAME, name))
+        || (policy = find_policy(settings, POLICY_MATCH_UUID, uuid))
+        || (tag[0] && (policy = find_policy(settings, POLICY_MATCH_TAG, tag))))
+        return &policy->config;
+    return &settings->global;
+}
+// ******************** End Policy Table ********************
+
+/*
+ * Global keys come first; each section then starts from the global values and
+ * overrides what it lists. Sections can not change interval or host_min_free,
+ * those are host-wide.
+ */
+int read_config(balloon_settings *settings) {
+    char line[256], key[32], value[64], kind[8];
+    vm_policy *policy = NULL;
     FILE *file = fopen(CONFIG_FILE, "r");
     if (file == NULL) {
-        generate_default_config_file();
-        goto out_default;
+        err_log("[%s] Can not open %s\n", __func__, CONFIG_FILE);
+        return -1;
     }
-    if (!fread(config_buffer, 1, sizeof(config_buffer), file)) {
-        goto out_close_file;
+
+    default_config(&settings->global);
+    settings->num_policies = 0;
+    memset(settings->index, -1, sizeof(settings->index));
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        if (line[0] == '[') {
+            if (policy == NULL && validate_config(&settings->global) < 0)
+                goto out_close_file;
+            if (policy && validate_config(&policy->config) < 0)
+                goto out_close_file;
+            if (sscanf(line, "[%7[^:]:%63[^]]]", kind, value) != 2
+                || !(policy = add_policy(settings, kind, value))) {
+                err_log("[%s] Bad config section: %s", __func__, line);
+                goto out_close_file;
+            }
+            continue;
+        }
+        if (sscanf(line, " %31[^= ] = %63s", key, value) != 2
+            || (policy && (!strcmp(key, "interval") || !strcmp(key, "host_min_free")))
+            || set_config_value(policy ? &policy->config : &settings->global, key, value) < 0) {
+            err_log("[%s] Bad config line: %s", __func__, line);
+            goto out_close_file;
+        }
     }
-    if (sscanf(config_buffer, "low_threshold=%f high_threshold=%f interval=%ld speed=%ld",
-            &config->low_threshold, &config->high_threshold, &config->interval, &config->speed) != 4) {
+    if (validate_config(policy ? &policy->config : &settings->global) < 0)
         goto out_close_file;
-    }
     fclose(file);
-    return;
+    return 0;
 
 out_close_file:
     fclose(file);
-out_default:
+    return -1;
+}
+
+/*
+ * Startup only: a missing or broken file means defaults, -1. The daemon writes
+ * the default file when there is none (create); the offline replay never does.
+ */
+int load_config(balloon_settings *settings, int create) {
+    if (create && access(CONFIG_FILE, F_OK) < 0)
+        generate_default_config_file();
+    if (read_config(settings) == 0) return 0;
+
     err_log("[%s] Error read config file. Use default config\n", __func__);
-    config->low_threshold = CONFIG_LOW_THRESHOLD_DEFAULT;
-    config->high_threshold = CONFIG_HIGH_THRESHOLD_DEFAULT;
-    config->interval = CONFIG_INTERVAL_DEFAULT;
-    config->speed = CONFIG_SPEED_DEFAULT;
+    default_config(&settings->global);
+    settings->num_policies = 0;
+    memset(settings->index, -1, sizeof(settings->index));
+    return -1;
 }
 
-vm_info get_vm_info(virDomainPtr dom) {
-    vm_info vm;
+// ******************** Libvirt Backend ********************
+/* libvirt reports to stderr unless told otherwise, its errors belong in the error log */
+void libvirt_error(void *data, virErrorPtr error) {
+    if (error->code == VIR_ERR_NO_DOMAIN_METADATA) return;     // no tag, see read_domain_tag
+    err_log("[libvirt] %s\n", error->message);
+}
+
+void *libvirt_open(const char *uri) {
+    virSetErrorFunc(NULL, libvirt_error);
+    return virConnectOpen(uri);
+}
+
+void libvirt_close(void *conn) {
+    virConnectClose(conn);
+}
+
+int libvirt_list(void *conn, int *ids, int max) {
+    return RPC(virConnectListDomains(conn, ids, max));
+}
+
+void *libvirt_lookup_id(void *conn, int id) {
+    return RPC(virDomainLookupByID(conn, id));
+}
+
+void *libvirt_lookup_uuid(void *conn, const unsigned char *uuid) {
+    return RPC(virDomainLookupByUUID(conn, uuid));
+}
+
+void libvirt_release(void *dom) {
+    virDomainFree(dom);
+}
+
+int libvirt_get_uuid(void *dom, unsigned char *uuid) {
+    return virDomainGetUUID(dom, uuid);
+}
+
+int libvirt_get_id(void *dom) {
+    return virDomainGetID(dom);
+}
+
+/* the tag attribute of our metadata element, left empty if there is none */
+void read_domain_tag(virDomainPtr dom, char *tag, size_t len) {
+    char *xml = RPC(virDomainGetMetadata(dom, VIR_DOMAIN_METADATA_ELEMENT,
+                                         BALLOON_METADATA_URI, VIR_DOMAIN_AFFECT_CURRENT));
+    char *p;
+
+    tag[0] = '\0';
+    if (!xml) {
+        /* most domains have no balloon metadata, that is not an error */
+        virErrorPtr error = virGetLastError();
+        if (error && error->code == VIR_ERR_NO_DOMAIN_METADATA)
+            virResetLastError();
+        return;
+    }
+    if ((p = strstr(xml, "tag=\""))) {
+        p += strlen("tag=\"");
+        snprintf(tag, len, "%.*s", (int)strcspn(p, "\""), p);
+    }
+    free(xml);
+}
+
+int libvirt_describe(void *dom, vm_entry *e) {
+    if (virDomainGetUUID(dom, e->uuid) < 0) return -1;
+    e->id = virDomainGetID(dom);
+    snprintf(e->name, sizeof(e->name), "%s", virDomainGetName(dom));
+    e->max = RPC(virDomainGetMaxMemory(dom));
+    virDomainGetUUIDString(dom, e->uuid_str);
+    read_domain_tag(dom, e->tag, sizeof(e->tag));
+    return 0;
+}
+
+/* only the dynamic part, static attributes come from the domain cache */
+int libvirt_sample(void *dom, vm_info *vm) {
     virDomainMemoryStatStruct stats[VIR_DOMAIN_MEMORY_STAT_NR];
 
-    vm.actual = 0;
-    vm.available = 0;
-    vm.max = virDomainGetMaxMemory(dom);
+    memset(vm, 0, sizeof(*vm));
 
-    int numStats = virDomainMemoryStats(dom, stats, VIR_DOMAIN_MEMORY_STAT_NR, 0);
+    int numStats = RPC(virDomainMemoryStats(dom, stats, VIR_DOMAIN_MEMORY_STAT_NR, 0));
     for (int i = 0; i < numStats; i++) {
         if (stats[i].tag == VIR_DOMAIN_MEMORY_STAT_ACTUAL_BALLOON)
-            vm.actual = stats[i].val;
+            vm->actual = stats[i].val;
         else if (stats[i].tag == VIR_DOMAIN_MEMORY_STAT_USABLE) {
-            vm.available = stats[i].val;
+            vm->available = stats[i].val;
         }
+        else if (stats[i].tag == VIR_DOMAIN_MEMORY_STAT_LAST_UPDATE)
+            vm->last_update = stats[i].val;
+        else if (stats[i].tag == VIR_DOMAIN_MEMORY_STAT_UNUSED)
+            vm->unused = stats[i].val;
+        else if (stats[i].tag == VIR_DOMAIN_MEMORY_STAT_DISK_CACHES)
+            vm->disk_caches = stats[i].val;
+        else if (stats[i].tag == VIR_DOMAIN_MEMORY_STAT_SWAP_IN)
+            vm->swap_in = stats[i].val;
+        else if (stats[i].tag == VIR_DOMAIN_MEMORY_STAT_MAJOR_FAULT)
+            vm->major_faults = stats[i].val;
     }
+    return numStats < 0 ? -1 : 0;
+}
+
+vm_info get_vm_info_from_record(virDomainStatsRecordPtr record) {
+    vm_info vm;
+    unsigned long long val;
+
+    memset(&vm, 0, sizeof(vm));
+    if (virTypedParamsGetULLong(record->params, record->nparams, "balloon.current", &val) == 1)
+        vm.actual = val;
+    if (virTypedParamsGetULLong(record->params, record->nparams, "balloon.usable", &val) == 1)
+        vm.available = val;
+    if (virTypedParamsGetULLong(record->params, record->nparams, "balloon.maximum", &val) == 1)
+        vm.max = val;
+    if (virTypedParamsGetULLong(record->params, record->nparams, "balloon.last-update", &val) == 1)
+        vm.last_update = val;
+    if (virTypedParamsGetULLong(record->params, record->nparams, "balloon.unused", &val) == 1)
+        vm.unused = val;
+    if (virTypedParamsGetULLong(record->params, record->nparams, "balloon.disk_caches", &val) == 1)
+        vm.disk_caches = val;
+    if (virTypedParamsGetULLong(record->params, record->nparams, "balloon.swap_in", &val) == 1)
+        vm.swap_in = val;
+    if (virTypedParamsGetULLong(record->params, record->nparams, "balloon.major_fault", &val) == 1)
+        vm.major_faults = val;
     return vm;
 }
 
-void ballooning() {
-    balloon_config config;
-    int vm_ids[MAX_NUM_OF_VM];
-    int num_VMs, i;
+/* one virConnectGetAllDomainStats round trip; the records go, the domains stay referenced */
+int libvirt_sample_all(void *conn, void **doms, vm_info *vms, int max) {
+    virDomainStatsRecordPtr *records = NULL;
+    int i, n = RPC(virConnectGetAllDomainStats(conn, VIR_DOMAIN_STATS_BALLOON,
+        &records, VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE));
 
-    for (;;) {
-        read_config(&config);
-        num_VMs = virConnectListDomains(connection, vm_ids, MAX_NUM_OF_VM);
-
-        for (i = 0; i < num_VMs; i++) {
-            virDomainPtr dom = virDomainLookupByID(connection, vm_ids[i]);
-            if (!dom) continue;
-
-            virDomainSetMemoryStatsPeriod(dom, config.interval, 0);
-            vm_info vm = get_vm_info(dom);
-            if (!vm.actual || !vm.available || !vm.max ) {
-                virDomainFree(dom);
-                continue;
-            }
+    for (i = 0; i < n && i < max; i++) {
+        virDomainRef(records[i]->dom);
+        doms[i] = records[i]->dom;
+        vms[i] = get_vm_info_from_record(records[i]);
+    }
+    if (records) virDomainStatsRecordListFree(records);
+    return n < 0 ? -1 : i;
+}
 
-            float pressure = (float)(vm.max - vm.available) / vm.max;
-            if (pressure < config.low_threshold) {
-                virDomainSetMemory(dom, vm.actual - config.speed);
-            } 
-            else if (pressure >= config.high_threshold) {
-                virDomainSetMemory(dom, vm.actual + 2*config.speed);
-            }
+int libvirt_set_period(void *dom, long int period) {
+    return RPC(virDomainSetMemoryStatsPeriod(dom, period, 0));
+}
 
-            fprintf(stdout, "[%s]: used:%ldMB | free: %ldMB | current: %ldMB | max: %ldMB | pressure: %.2f%%\n",
-                virDomainGetName(dom), (vm.actual - vm.available) >> 10, vm.available >> 10, vm.actual >> 10, vm.max >> 10, pressure * 100);
+int libvirt_set_memory(void *dom, long int kb) {
+    return RPC(virDomainSetMemory(dom, kb));
+}
 
-            virDomainFree(dom);
-        }
-        sleep(config.interval);
-    }
+const balloon_backend libvirt_backend = {
+    "libvirt", "",
+    libvirt_open, libvirt_close, libvirt_list, libvirt_lookup_id, libvirt_lookup_uuid,
+    libvirt_release, libvirt_get_uuid, libvirt_get_id, libvirt_describe, libvirt_sample, libvirt_sample_all,
+    libvirt_set_period, libvirt_set_memory, NULL, NULL, NULL,
+};
+// ******************** End Libvirt Backend ********************
+
+// ******************** Simulator ********************
+/*
+ * Deterministic in-process hypervisor for scale tests, "sim://N[/SEED]" runs N
+ * guests. Used memory follows a daily wave plus seeded bursts; a resize starts
+ * moving the balloon SIM_BALLOON_LATENCY seconds later at SIM_BALLOON_RATE.
+ * Memory the guest wants beyond the balloon is swapped, and a hot page cache
+ * squeezed below its size is reread, both over SIM_TOUCH seconds.
+ * Simulated time only moves between sweeps, by the sweep interval, so a day of
+ * load runs in seconds. Same N and SEED, same guests and same demand.
+ */
+unsigned long sim_hash(unsigned long x) {     // splitmix64
+    x += 0x9e3779b97f4a7c15UL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+    return x ^ (x >> 31);
 }
 
-int main() {
-    create_file_if_not_exist();
+/* KB the guest wants at simulated second t */
+long int sim_used(const sim_vm *s, long int t) {
+    long int window = t / SIM_BURST_WINDOW, used;
+    unsigned long h = sim_hash(s->seed ^ window);
 
-    connection = virConnectOpen("qemu:///system");
-    if (connection == NULL) {
-        fprintf(stderr, "Failed to open connection to the hypervisor\n");
+    used = s->base + (long int)(s->wave * (1 + sin(2 * M_PI * (t + s->phase) / SIM_DAY)) / 2);
+    if (h % 4 == 0 && t % SIM_BURST_WINDOW < (long int)((h >> 8) % SIM_BURST_WINDOW))
+        used += (h >> 24) % (s->max / 4);
+    return MIN(used, s->max - (64 << 10));
+}
+
+/* where the balloon is at simulated ms now, caller holds s->lock */
+long int sim_position(const sim_vm *s, double now) {
+    long int step;
+    if (s->actual == s->target || now < s->moving_at) return s->actual;
+    step = (long int)(SIM_BALLOON_RATE * (now - s->moving_at) / 1000);
+    if (s->target > s->actual) return MIN(s->actual + step, s->target);
+    return MAX(s->actual - step, s->target);
+}
+
+void *sim_open(const char *uri) {
+    const char *p = uri + strlen("sim://");
+    unsigned long seed = 1;
+    sim_vm *s;
+    int i, n = atoi(p);
+
+    if ((p = strchr(p, '/'))) seed = strtoul(p + 1, NULL, 10);
+    pthread_mutex_lock(&sim_lock);
+    if (!sim_num_vms) {
+        sim_num_vms = MAX(MIN(n, MAX_NUM_OF_VM), 1);
+        for (i = 0; i < sim_num_vms; i++) {
+            s = &sim_vms[i];
+            s->seed = sim_hash(seed * MAX_NUM_OF_VM + i);
+            pthread_mutex_init(&s->lock, NULL);
+            memcpy(s->uuid, &s->seed, sizeof(s->seed));
+            memcpy(s->uuid + VIR_UUID_BUFLEN - sizeof(i), &i, sizeof(i));
+            snprintf(s->name, sizeof(s->name), "sim%d", i + 1);
+            s->max = (2 + s->seed % 15) << 20;
+            s->base = s->max * (20 + (s->seed >> 8) % 20) / 100;
+            s->wave = s->max * (10 + (s->seed >> 16) % 30) / 100;
+            s->phase = (s->seed >> 24) % SIM_DAY;
+            s->cache = s->max * (5 + (s->seed >> 32) % 20) / 100;
+            s->actual = s->target = s->max;
+        }
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return sim_vms;
+}
+
+void sim_close(void *conn) {
+}
+
+int sim_list(void *conn, int *ids, int max) {
+    int i;
+    for (i = 0; i < sim_num_vms && i < max; i++)
+        ids[i] = i + 1;
+    return i;
+}
+
+void *sim_lookup_id(void *conn, int id) {
+    return id >= 1 && id <= sim_num_vms ? &sim_vms[id - 1] : NULL;
+}
+
+void *sim_lookup_uuid(void *conn, const unsigned char *uuid) {
+    int i;
+    memcpy(&i, uuid + VIR_UUID_BUFLEN - sizeof(i), sizeof(i));
+    if (i < 0 || i >= sim_num_vms || memcmp(sim_vms[i].uuid, uuid, VIR_UUID_BUFLEN)) return NULL;
+    return &sim_vms[i];
+}
+
+void sim_release(void *dom) {
+}
+
+int sim_get_uuid(void *dom, unsigned char *uuid) {
+    memcpy(uuid, ((sim_vm *)dom)->uuid, VIR_UUID_BUFLEN);
+    return 0;
+}
+
+int sim_get_id(void *dom) {
+    return (sim_vm *)dom - sim_vms + 1;
+}
+
+int sim_describe(void *dom, vm_entry *e) {
+    sim_vm *s = dom;
+    const unsigned char *u = s->uuid;
+
+    memcpy(e->uuid, s->uuid, VIR_UUID_BUFLEN);
+    e->id = sim_get_id(dom);
+    snprintf(e->name, sizeof(e->name), "%s", s->name);
+    e->max = s->max;
+    snprintf(e->uuid_str, sizeof(e->uuid_str),
+        "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+        u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+    return 0;
+}
+
+int sim_sample(void *dom, vm_info *vm) {
+    sim_vm *s = dom;
+    long int t = sim_now / 1000, free;
+
+    memset(vm, 0, sizeof(*vm));
+    pthread_mutex_lock(&s->lock);
+    vm->actual = sim_position(s, sim_now);
+    pthread_mutex_unlock(&s->lock);
+    free = vm->actual - sim_used(s, t);
+    vm->available = MAX(free, 1);
+    vm->disk_caches = MIN(MAX(free, 0), s->cache);
+    vm->unused = MAX(free - vm->disk_caches, 0);
+    vm->max = s->max;
+    vm->last_update = t;
+    vm->swap_in = s->swap_in;
+    vm->major_faults = s->faults;
+    return 0;
+}
+
+int sim_sample_all(void *conn, void **doms, vm_info *vms, int max) {
+    int i;
+    for (i = 0; i < sim_num_vms && i < max; i++) {
+        doms[i] = &sim_vms[i];
+        sim_sample(doms[i], &vms[i]);
+    }
+    return i;
+}
+
+int sim_set_period(void *dom, long int period) {
+    ((sim_vm *)dom)->period = period;
+    return 0;
+}
+
+int sim_set_memory(void *dom, long int kb) {
+    sim_vm *s = dom;
+    int direction;
+
+    pthread_mutex_lock(&s->lock);
+    s->actual = sim_position(s, sim_now);
+    direction = (kb > s->actual) - (kb < s->actual);
+    if (s->direction && direction && direction != s->direction && sim_now - s->resized_at < THRASH_WINDOW * 1000)
+        sim_stats.reversals++;
+    if (direction) {
+        sim_stats.resizes++;
+        s->direction = direction;
+        s->resized_at = sim_now;
+    }
+    s->target = MIN(kb, s->max);
+    s->moving_at = sim_now + SIM_BALLOON_LATENCY * 1000;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+/* move the clock and score every guest at the new time, weighted by the step */
+void sim_advance(long int ms) {
+    double seconds = ms / 1000.0;
+    long int t, used, actual, swapped, evicted;
+    int i;
+
+    sim_now += ms;
+    t = sim_now / 1000;
+    for (i = 0; i < sim_num_vms; i++) {
+        sim_vm *s = &sim_vms[i];
+        pthread_mutex_lock(&s->lock);
+        actual = sim_position(s, sim_now);
+        pthread_mutex_unlock(&s->lock);
+        used = sim_used(s, t);
+        swapped = MAX(used - actual, 0);
+        evicted = s->cache - MIN(MAX(actual - used, 0), s->cache);
+        s->swap_in += seconds * swapped / SIM_TOUCH;
+        s->faults += seconds * (swapped + evicted) / 4 / SIM_TOUCH;     // 4KB pages
+        sim_stats.swap_in += seconds * swapped / SIM_TOUCH;
+        sim_stats.faults += seconds * (swapped + evicted) / 4 / SIM_TOUCH;
+        sim_stats.reclaimed += seconds * (s->max - actual);
+        sim_stats.seconds += seconds;
+        sim_stats.pressure_seconds += (actual - used < actual / 10) * seconds;
+        sim_stats.starved_seconds += (used > actual) * seconds;
+        sim_stats.held += seconds * actual / s->max;
+        if (s->period) sim_stats.pushes += seconds / s->period;
+    }
+}
+
+double sim_clock_ms() {
+    return sim_now;
+}
+
+/* scores since the last report */
+void sim_report(FILE *out) {
+    if (!sim_stats.seconds) return;
+    fprintf(out, "sim: %d VMs | %.1f simulated hours | balloon at %.1f%% of max | "
+        "%.2f%% of VM time under 10%% free | %.2f%% starved | %.0f stats pushes per VM-hour\n"
+        "sim: per reclaimed GB-hour | %.1f MB swapped in | %.0f major faults | "
+        "%.1f resizes per VM-hour, %.1f%% reversing the last one\n",
+        sim_num_vms, sim_now / 3.6e6, 100 * sim_stats.held / sim_stats.seconds,
+        100 * sim_stats.pressure_seconds / sim_stats.seconds, 100 * sim_stats.starved_seconds / sim_stats.seconds,
+        sim_stats.pushes * 3600 / sim_stats.seconds,
+        sim_stats.reclaimed ? sim_stats.swap_in / 1024 / (sim_stats.reclaimed / 3600 / (1 << 20)) : 0,
+        sim_stats.reclaimed ? sim_stats.faults / (sim_stats.reclaimed / 3600 / (1 << 20)) : 0,
+        sim_stats.resizes * 3600 / sim_stats.seconds,
+        sim_stats.resizes ? 100 * sim_stats.reversals / sim_stats.resizes : 0);
+    memset(&sim_stats, 0, sizeof(sim_stats));
+}
+
+const balloon_backend sim_backend = {
+    "sim", "sim://",
+    sim_open, sim_close, sim_list, sim_lookup_id, sim_lookup_uuid,
+    sim_release, sim_get_uuid, sim_get_id, sim_describe, sim_sample, sim_sample_all,
+    sim_set_period, sim_set_memory, sim_advance, sim_clock_ms, sim_report,
+};
+// ******************** End Simulator ********************
+
+/* the first backend whose URI prefix matches, libvirt takes everything else */
+const balloon_backend *backends[] = { &sim_backend, &libvirt_backend };
+
+const balloon_backend *find_backend(const char *uri) {
+    unsigned int i;
+    for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+        if (!strncmp(uri, backends[i]->prefix, strlen(backends[i]->prefix)))
+            return backends[i];
+    return NULL;
+}
+
+double backend_clock_ms() {
+    return backend->clock_ms ? backend->clock_ms() : now_ms();
+}
+
+// ******************** Scheduler ********************
+/*
+ * Every VM is sampled on its own period, between min_interval and
+ * max_interval, and the guest is asked to push stats at that period. Cache
+ * slots sit in a binary min-heap ordered by next_sample. A sweep takes every
+ * VM due within SCHEDULE_SLACK_MS, so close deadlines share one wakeup, and
+ * puts them back with the period their sample earned.
+ */
+void schedule_swap(int i, int j) {
+    int slot = schedule_heap[i];
+    schedule_heap[i] = schedule_heap[j];
+    schedule_heap[j] = slot;
+    vm_cache[schedule_heap[i]].heap_pos = i + 1;
+    vm_cache[schedule_heap[j]].heap_pos = j + 1;
+}
+
+int schedule_before(int i, int j) {
+    return vm_cache[schedule_heap[i]].next_sample < vm_cache[schedule_heap[j]].next_sample;
+}
+
+void schedule_fix(int i) {
+    int child;
+    for (; i > 0 && schedule_before(i, (i - 1) / 2); i = (i - 1) / 2)
+        schedule_swap(i, (i - 1) / 2);
+    for (; (child = 2 * i + 1) < schedule_len; i = child) {
+        if (child + 1 < schedule_len && schedule_before(child + 1, child)) child++;
+        if (!schedule_before(child, i)) break;
+        schedule_swap(i, child);
+    }
+}
+
+void schedule_add(vm_entry *e, double when) {
+    e->next_sample = when;
+    schedule_heap[schedule_len] = e - vm_cache;
+    e->heap_pos = ++schedule_len;
+    schedule_fix(schedule_len - 1);
+}
+
+void schedule_remove(vm_entry *e) {
+    int i = e->heap_pos - 1;
+
+    if (!e->heap_pos) return;
+    schedule_swap(i, --schedule_len);
+    e->heap_pos = 0;
+    if (i < schedule_len) schedule_fix(i);
+}
+
+/* take every VM due by now, they stay out of the heap until schedule_requeue */
+int schedule_take(double now) {
+    vm_entry *e;
+    int n = 0;
+
+    while (schedule_len && vm_cache[schedule_heap[0]].next_sample <= now + SCHEDULE_SLACK_MS) {
+        e = &vm_cache[schedule_heap[0]];
+        schedule_remove(e);
+        e->due = 1;
+        sweep_due[n++] = e - vm_cache;
+    }
+    return n;
+}
+
+void schedule_requeue(int n, double now) {
+    vm_entry *e;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        e = &vm_cache[sweep_due[i]];
+        if (!e->dom) continue;      // evicted
+        e->due = 0;
+        schedule_add(e, now + e->sample_period * 1000);
+    }
+}
+
+/* ms until the next VM is due, never longer than the global interval so new domains are found */
+long int schedule_wait_ms(double now) {
+    long int wait = settings.global.interval * 1000;
+    if (schedule_len)
+        wait = MIN(wait, (long int)(vm_cache[schedule_heap[0]].next_sample - now));
+    return MAX(wait, 0);
+}
+
+/*
+ * Halve the period when pressure is outside the band, the balloon takes a big
+ * step, demand moves fast or would reach a band edge before the next sample
+ * at its current drift; stretch it by half otherwise. Drift is measured on
+ * used memory, so the balloon's own moves do not count as activity.
+ */
+void adapt_period(vm_entry *e, const vm_info *vm, const balloon_config *config) {
+    float pressure = vm_pressure(vm), used = (float)(vm->actual - vm->available) / vm->max;
+    float edge = MIN(pressure - config->low_threshold, config->high_threshold - pressure);
+    float drift = fabs(used - e->last_used);
+    int busy = edge < 0 || labs(e->target - vm->actual) * ADAPT_MOVE > vm->max
+        || drift > ADAPT_DRIFT || 2 * drift > edge;
+
+    if (busy)
+        e->sample_period = e->sample_period / 2;
+    else
+        e->sample_period += MAX(e->sample_period / 2, 1);
+    e->sample_period = MAX(MIN(e->sample_period, config->max_interval), config->min_interval);
+    e->last_used = used;
+}
+// ******************** End Scheduler ********************
+
+// ******************** Host Cgroup ********************
+/*
+ * Host view of a VM from the cgroup v2 scope libvirt runs its QEMU in: the
+ * "some" stall time in memory.pressure and the guest memory QEMU holds
+ * (anon + shmem) in memory.stat. Both files stay open and are reread with
+ * pread. The scope is found by domain ID under machine.slice (systemd) or
+ * machine (cgroupfs driver), below cgroup_root.
+ */
+const char *cgroup_root = NULL;
+
+int cgroup_find(int id, char *path, size_t size) {
+    static const char *layouts[][2] = {
+        { "machine.slice", "machine-qemu\\x2d%d\\x2d" },
+        { "machine", "qemu-%d-" },
+    };
+    char prefix[64];
+    struct dirent *d;
+    DIR *dir;
+    size_t i;
+    int found = 0;
+
+    for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]) && !found; i++) {
+        snprintf(path, size, "%s/%s", cgroup_root, layouts[i][0]);
+        if (!(dir = opendir(path))) continue;
+        snprintf(prefix, sizeof(prefix), layouts[i][1], id);
+        while (!found && (d = readdir(dir)))
+            if (!strncmp(d->d_name, prefix, strlen(prefix))) {
+                snprintf(path, size, "%s/%s/%s", cgroup_root, layouts[i][0], d->d_name);
+                found = 1;
+            }
+        closedir(dir);
+    }
+    return found ? 0 : -1;
+}
+
+void cgroup_attach(vm_entry *e) {
+    char dir[PATH_MAX], path[PATH_MAX + 32];
+
+    e->cgroup_pressure = e->cgroup_stat = -1;
+    if (!cgroup_root || e->id <= 0 || cgroup_find(e->id, dir, sizeof(dir)) < 0) return;
+    snprintf(path, sizeof(path), "%s/memory.pressure", dir);
+    e->cgroup_pressure = open(path, O_RDONLY | O_CLOEXEC);
+    snprintf(path, sizeof(path), "%s/memory.stat", dir);
+    e->cgroup_stat = open(path, O_RDONLY | O_CLOEXEC);
+    if (e->cgroup_pressure < 0 && e->cgroup_stat < 0)
+        err_log("[%s] No memory.pressure or memory.stat in %s\n", __func__, dir);
+}
+
+void cgroup_detach(vm_entry *e) {
+    if (e->cgroup_pressure >= 0) close(e->cgroup_pressure);
+    if (e->cgroup_stat >= 0) close(e->cgroup_stat);
+    e->cgroup_pressure = e->cgroup_stat = -1;
+}
+
+unsigned long long cgroup_stat_value(const char *stat, const char *key) {
+    size_t len = strlen(key);
+    const char *p = stat;
+
+    while (p) {
+        if (!strncmp(p, key, len) && p[len] == ' ') return strtoull(p + len + 1, NULL, 10);
+        if ((p = strchr(p, '\n'))) p++;
+    }
+    return 0;
+}
+
+/* fill rss and stall; 1 if a new stall share was measured, at most once a second */
+int cgroup_sample(vm_entry *e, vm_info *vm) {
+    char buf[CGROUP_READ_BUFFER], *p;
+    unsigned long long total;
+    double now;
+    ssize_t n;
+    int fresh = 0;
+
+    if (e->cgroup_pressure >= 0 && (n = pread(e->cgroup_pressure, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = 0;
+        now = now_ns() / 1e9;
+        /* the first line is "some" */
+        if ((p = strstr(buf, "total=")) && now - e->psi_at >= 1) {
+            total = strtoull(p + strlen("total="), NULL, 10);
+            if (e->psi_at && total >= e->psi_total)
+                e->stall = MIN((total - e->psi_total) / 1e6 / (now - e->psi_at), 1);
+            e->psi_total = total;
+            e->psi_at = now;
+            fresh = 1;
+        }
+    }
+    if (e->cgroup_stat >= 0 && (n = pread(e->cgroup_stat, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = 0;
+        vm->rss = (cgroup_stat_value(buf, "anon") + cgroup_stat_value(buf, "shmem")) >> 10;
+    }
+    vm->stall = e->stall;
+    return fresh;
+}
+// ******************** End Host Cgroup ********************
+
+// ******************** Daemon ********************
+/*
+ * systemd integration without libsystemd: sd_notify(3) is one datagram to
+ * $NOTIFY_SOCKET, the watchdog is pinged at half of $WATCHDOG_USEC. Nothing
+ * happens outside systemd.
+ */
+void notify_systemd(const char *fmt, ...) {
+    static int fd = -1;
+    const char *path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char msg[256];
+    va_list args;
+    int len;
+
+    if (!path || (path[0] != '/' && path[0] != '@') || strlen(path) >= sizeof(addr.sun_path)) return;
+    if (fd < 0 && (fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) return;
+    memcpy(addr.sun_path, path, strlen(path));
+    if (addr.sun_path[0] == '@') addr.sun_path[0] = 0;     // abstract namespace
+    va_start(args, fmt);
+    len = vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    sendto(fd, msg, MIN(len, (int)sizeof(msg) - 1), MSG_NOSIGNAL, (struct sockaddr *)&addr,
+        offsetof(struct sockaddr_un, sun_path) + strlen(path));
+}
+
+/* half of $WATCHDOG_USEC in ms, 0 without a watchdog */
+long int watchdog_interval_ms() {
+    static long int ms = -1;
+    const char *env;
+
+    if (ms < 0) ms = (env = getenv("WATCHDOG_USEC")) && atol(env) > 0 ? MAX(atol(env) / 2000, 1) : 0;
+    return ms;
+}
+
+/*
+ * Called at least once per interval, by the poll loop or the event-mode timer,
+ * whether or not there is anything to balloon. Pings more than half an
+ * interval apart, so a ping is never later than 3/4 of $WATCHDOG_USEC.
+ */
+void watchdog_ping() {
+    static double last = 0;
+    long int ms = watchdog_interval_ms();
+
+    if (!ms || now_ms() - last < ms / 2.0) return;
+    last = now_ms();
+    notify_systemd("WATCHDOG=1");
+}
+
+/*
+ * From the config watcher: the first signal stops after the current sweep, a
+ * repeat a second later exits at once. Sooner is the same signal sent to the
+ * process and to its group, as timeout(1) does.
+ */
+void request_stop(int signo) {
+    static double first = 0;
+    uint64_t one = 1;
+
+    if (__atomic_exchange_n(&stopping, 1, __ATOMIC_ACQ_REL)) {
+        if (now_ms() - first > 1000) _exit(1);
+        return;
+    }
+    first = now_ms();
+    log_msg(LOG_INFO, "%s, stopping\n", strsignal(signo));
+    if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0)
+        err_log("[%s] Can not wake the control loop\n", __func__);
+    if (tick_timer >= 0)
+        virEventUpdateTimeout(tick_timer, 0);
+}
+
+int stop_requested() {
+    return __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+}
+
+/* first sweep with a controller decision, measured from the start of main */
+void note_first_decision() {
+    if (first_decision_ns || !__atomic_load_n(&decisions, __ATOMIC_RELAXED)) return;
+    first_decision_ns = now_ns();
+    log_msg(LOG_INFO, "first decision %.1fms after start, %d of %d VMs resumed from the checkpoint\n",
+        (first_decision_ns - start_ns) / 1e6, num_resumed, vm_cache_count);
+}
+
+/*
+ * Checkpoint: the trace's 64-byte header, then one checkpoint_record per
+ * cached VM. Written to a temporary file and renamed over the old one, so a
+ * crash leaves either checkpoint whole. Not fsynced: it is only a head start,
+ * and a file cut short by a power loss fails the checks on load like one from
+ * a build with another record layout.
+ */
+int checkpoint_compare(const void *a, const void *b) {
+    return memcmp(a, b, VIR_UUID_BUFLEN);
+}
+
+int checkpoint_save() {
+    static checkpoint_record records[MAX_NUM_OF_VM];
+    char tmp[PATH_MAX];
+    trace_header header;
+    const vm_entry *e;
+    double now = backend_clock_ms();
+    int fd, slot, n = 0;
+    ssize_t size;
+
+    if (!checkpoint_path) return 0;
+    for (slot = 0; slot < MAX_NUM_OF_VM; slot++) {
+        e = &vm_cache[slot];
+        if (!e->dom) continue;
+        memset(&records[n], 0, sizeof(records[n]));
+        memcpy(records[n].uuid, e->uuid, VIR_UUID_BUFLEN);
+        records[n].ctrl = e->ctrl;
+        records[n].sample_period = e->sample_period;
+        records[n].last_update = e->last_update;
+        records[n].last_used = e->last_used;
+        records[n].distress = e->distress;
+        records[n].pending = e->pending;
+        records[n].pending_from = e->pending_from;
+        records[n].pending_age = e->pending ? now - e->pending_since : 0;
+        records[n].rails = e->rails;
+        records[n].rails.refilled_at = now - e->rails.refilled_at;
+        records[n].rails.acted_at = now - e->rails.acted_at;
+        n++;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.record_size = sizeof(checkpoint_record);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", checkpoint_path);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) goto fail;
+    size = n * sizeof(checkpoint_record);
+    if (write(fd, &header, sizeof(header)) != sizeof(header) || write(fd, records, size) != size) {
+        close(fd);
+        unlink(tmp);
+        goto fail;
+    }
+    close(fd);
+    if (rename(tmp, checkpoint_path) == 0) return 0;
+fail:
+    err_log("[%s] Can not write %s: %s\n", __func__, checkpoint_path, strerror(errno));
+    return -1;
+}
+
+void checkpoint_tick() {
+    static double last = 0;
+
+    if (!checkpoint_path || now_ms() - last < CHECKPOINT_INTERVAL * 1000) return;
+    if (last) checkpoint_save();
+    last = now_ms();
+}
+
+void checkpoint_load() {
+    trace_header header;
+    struct stat st;
+    int fd;
+
+    if (!checkpoint_path || (fd = open(checkpoint_path, O_RDONLY | O_CLOEXEC)) < 0) return;
+    if (fstat(fd, &st) < 0 || read(fd, &header, sizeof(header)) != sizeof(header)
+        || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic))
+        || header.version != CHECKPOINT_VERSION || header.record_size != sizeof(checkpoint_record)) {
+        err_log("[%s] Ignoring %s, not a checkpoint of this version\n", __func__, checkpoint_path);
+        close(fd);
+        return;
+    }
+    if ((st.st_size - sizeof(header)) % sizeof(checkpoint_record)) {
+        err_log("[%s] Ignoring %s, cut short\n", __func__, checkpoint_path);
+        close(fd);
+        return;
+    }
+    num_restored = MIN((st.st_size - (off_t)sizeof(header)) / (off_t)sizeof(checkpoint_record), MAX_NUM_OF_VM);
+    restored = calloc(MAX(num_restored, 1), sizeof(checkpoint_record));
+    if (!restored || read(fd, restored, num_restored * sizeof(checkpoint_record))
+            != (ssize_t)(num_restored * sizeof(checkpoint_record))) {
+        err_log("[%s] Short read from %s\n", __func__, checkpoint_path);
+        num_restored = 0;
+    }
+    close(fd);
+    qsort(restored, num_restored, sizeof(checkpoint_record), checkpoint_compare);
+}
+
+/*
+ * A VM the last run knew: learned state back, a resize it left moving is waited
+ * for, not resent. Each record is used once, a VM that restarts later starts fresh.
+ */
+void checkpoint_restore(vm_entry *e) {
+    checkpoint_record *r;
+
+    if (!num_restored) return;
+    r = bsearch(e->uuid, restored, num_restored, sizeof(checkpoint_record), checkpoint_compare);
+    if (!r) return;
+    e->ctrl = r->ctrl;
+    if (r->sample_period > 0) e->sample_period = r->sample_period;
+    e->last_update = r->last_update;
+    e->last_used = r->last_used;
+    e->distress = r->distress;
+    e->rails = r->rails;
+    e->rails.refilled_at = backend_clock_ms() - r->rails.refilled_at;
+    e->rails.acted_at = backend_clock_ms() - r->rails.acted_at;
+    if (r->pending) {
+        e->pending = r->pending;
+        e->pending_from = r->pending_from;
+        e->pending_since = backend_clock_ms() - r->pending_age;
+        e->resize_seq = 1;      // resize_failed stays 0, the resize is not counted as failed
+    }
+    num_resumed++;
+    memmove(r, r + 1, (restored + --num_restored - r) * sizeof(*r));
+}
+
+/* after the first sync: what is left belongs to VMs that did not come back with us */
+void checkpoint_release() {
+    free(restored);
+    restored = NULL;
+    num_restored = 0;
+}
+// ******************** End Daemon ********************
+
+// ******************** Domain Cache ********************
+/*
+ * Entries live in fixed slots of vm_cache for as long as the domain runs,
+ * indexed twice with linear probing: by UUID (events, bulk records) and by
+ * ID (virConnectListDomains). Nothing is allocated after a domain is seen.
+ */
+unsigned int hash_uuid(const unsigned char *uuid) {
+    unsigned int h;
+    memcpy(&h, uuid, sizeof(h));
+    return h & (VM_CACHE_BUCKETS - 1);
+}
+
+unsigned int hash_id(int id) {
+    return ((unsigned int)id * 2654435761u) & (VM_CACHE_BUCKETS - 1);
+}
+
+unsigned int bucket_of(int *index, int slot) {
+    return index == index_by_uuid ? hash_uuid(vm_cache[slot].uuid) : hash_id(vm_cache[slot].id);
+}
+
+void index_insert(int *index, int slot) {
+    unsigned int h = bucket_of(index, slot);
+    while (index[h] >= 0)
+        h = (h + 1) & (VM_CACHE_BUCKETS - 1);
+    index[h] = slot;
+}
+
+/* backward-shift deletion, so lookups never need tombstones */
+void index_remove(int *index, int slot) {
+    unsigned int h = bucket_of(index, slot), j, k;
+
+    while (index[h] != slot)
+        h = (h + 1) & (VM_CACHE_BUCKETS - 1);
+    for (j = h;;) {
+        j = (j + 1) & (VM_CACHE_BUCKETS - 1);
+        if (index[j] < 0) break;
+        k = bucket_of(index, index[j]);
+        if (((j - k) & (VM_CACHE_BUCKETS - 1)) >= ((j - h) & (VM_CACHE_BUCKETS - 1))) {
+            index[h] = index[j];
+            h = j;
+        }
+    }
+    index[h] = -1;
+}
+
+void vm_cache_init() {
+    memset(index_by_uuid, -1, sizeof(index_by_uuid));
+    memset(index_by_id, -1, sizeof(index_by_id));
+}
+
+vm_entry *vm_cache_find_uuid(const unsigned char *uuid) {
+    unsigned int h = hash_uuid(uuid);
+    for (; index_by_uuid[h] >= 0; h = (h + 1) & (VM_CACHE_BUCKETS - 1))
+        if (!memcmp(vm_cache[index_by_uuid[h]].uuid, uuid, VIR_UUID_BUFLEN))
+            return &vm_cache[index_by_uuid[h]];
+    return NULL;
+}
+
+vm_entry *vm_cache_find_id(int id) {
+    unsigned int h = hash_id(id);
+    for (; index_by_id[h] >= 0; h = (h + 1) & (VM_CACHE_BUCKETS - 1))
+        if (vm_cache[index_by_id[h]].id == id)
+            return &vm_cache[index_by_id[h]];
+    return NULL;
+}
+
+/* config reloads move the policies around, point every entry at its new one */
+void vm_cache_resolve_policies() {
+    int slot;
+    for (slot = 0; slot < MAX_NUM_OF_VM; slot++)
+        if (vm_cache[slot].dom)
+            vm_cache[slot].config = resolve_policy(&settings, vm_cache[slot].name,
+                                                   vm_cache[slot].uuid_str, vm_cache[slot].tag);
+}
+
+/* the dispatcher's handle for this slot is stale from now on, wake it to let go of it */
+void dispatch_forget(int slot) {
+    __atomic_add_fetch(&slot_generation[slot], 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&resize_lock);
+    pthread_cond_signal(&resize_cond);
+    pthread_mutex_unlock(&resize_lock);
+}
+
+/*
+ * A domain restarted under the same UUID has a new ID, QEMU process and cgroup
+ * scope: move the entry to the new ID and handle and reopen the cgroup files.
+ * The stall share starts over, the old scope's counter means nothing here.
+ */
+void vm_cache_rebind(vm_entry *e, void *dom) {
+    int slot = e - vm_cache;
+
+    index_remove(index_by_id, slot);
+    e->id = backend->get_id(dom);
+    index_insert(index_by_id, slot);
+    cgroup_detach(e);
+    e->psi_total = 0;
+    e->psi_at = e->stall = 0;
+    cgroup_attach(e);
+    if (e->shard_dom && e->shard_dom != e->dom)
+        backend->release(e->shard_dom);
+    e->shard_dom = NULL;
+    backend->release(e->dom);
+    e->dom = dom;
+    dispatch_forget(slot);
+    log_msg(LOG_INFO, "[%s]: restarted as domain %d\n", e->name, e->id);
+}
+
+/* takes over the caller's reference to dom and pulls the static attributes once */
+vm_entry *vm_cache_insert(void *dom) {
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    vm_entry *e = NULL;
+    int slot;
+
+    if (backend->get_uuid(dom, uuid) < 0) {
+        backend->release(dom);
+        return NULL;
+    }
+    if ((e = vm_cache_find_uuid(uuid))) {
+        if (backend->get_id(dom) != e->id)
+            vm_cache_rebind(e, dom);
+        else
+            backend->release(dom);
+        return e;
+    }
+
+    for (slot = 0; slot < MAX_NUM_OF_VM && vm_cache[slot].dom; slot++);
+    if (slot == MAX_NUM_OF_VM) {
+        err_log("[%s] Domain cache is full\n", __func__);
+        backend->release(dom);
+        return NULL;
+    }
+
+    e = &vm_cache[slot];
+    memset(e, 0, sizeof(*e));
+    if (backend->describe(dom, e) < 0) {
+        memset(e, 0, sizeof(*e));
+        backend->release(dom);
+        return NULL;
+    }
+    e->dom = dom;
+    e->seen = sweep_generation;
+    e->sample_period = settings.global.interval;
+    e->config = resolve_policy(&settings, e->name, e->uuid_str, e->tag);
+    cgroup_attach(e);
+    checkpoint_restore(e);
+
+    index_insert(index_by_uuid, slot);
+    index_insert(index_by_id, slot);
+    schedule_add(e, backend_clock_ms());
+    vm_cache_count++;
+    return e;
+}
+
+void vm_cache_remove(vm_entry *e) {
+    int slot = e - vm_cache;
+
+    index_remove(index_by_uuid, slot);
+    index_remove(index_by_id, slot);
+    schedule_remove(e);
+    cgroup_detach(e);
+    if (e->shard_dom && e->shard_dom != e->dom)
+        backend->release(e->shard_dom);
+    backend->release(e->dom);
+    memset(e, 0, sizeof(*e));
+    dispatch_forget(slot);
+    vm_cache_count--;
+}
+
+/* drop domains that were not listed in the current sweep */
+void vm_cache_evict_stale() {
+    int slot;
+    for (slot = 0; slot < MAX_NUM_OF_VM; slot++)
+        if (vm_cache[slot].dom && vm_cache[slot].seen != sweep_generation)
+            vm_cache_remove(&vm_cache[slot]);
+}
+// ******************** End Domain Cache ********************
+
+// ******************** Config Reload ********************
+/*
+ * A watcher thread waits on inotify (the directory, so editors that replace
+ * the file by rename are seen) and on SIGHUP. Each change is parsed and
+ * validated off the control loop and published through pending_settings; the
+ * loop swaps it in between sweeps. A broken edit keeps the running config.
+ */
+balloon_settings *pending_settings = NULL;
+
+void *config_watcher(void *data) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    struct pollfd fds[2];
+    balloon_settings *candidate, *stale;
+    sigset_t mask;
+    ssize_t len;
+    int changed;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    fds[0].fd = inotify_init1(IN_CLOEXEC);
+    fds[1].fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    fds[0].events = fds[1].events = POLLIN;
+    if (fds[0].fd < 0 || inotify_add_watch(fds[0].fd, CONFIG_DIR, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        err_log("[%s] Can not watch %s, reload with SIGHUP only\n", __func__, CONFIG_DIR);
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) continue;
+        changed = 0;
+        if (fds[0].revents & POLLIN) {
+            len = read(fds[0].fd, buf, sizeof(buf));
+            for (char *p = buf; len > 0 && p < buf + len; p += sizeof(*event) + event->len) {
+                event = (struct inotify_event *)p;
+                if (event->len && !strcmp(event->name, CONFIG_FILE_NAME)) changed = 1;
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(fds[1].fd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGUSR1)
+                    profile_dump();
+                else if (info.ssi_signo == SIGTERM || info.ssi_signo == SIGINT)
+                    request_stop(info.ssi_signo);
+                else
+                    changed = 1;
+            }
+        }
+        if (!changed) continue;
+
+        candidate = malloc(sizeof(*candidate));
+        if (candidate == NULL || read_config(candidate) < 0) {
+            err_log("[%s] Rejected new config, keeping the running one\n", __func__);
+            free(candidate);
+            continue;
+        }
+        stale = __atomic_exchange_n(&pending_settings, candidate, __ATOMIC_ACQ_REL);
+        free(stale);
+    }
+    return NULL;
+}
+
+/* SIGHUP must already be blocked in every thread, see main() */
+int start_config_watcher() {
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, config_watcher, NULL)) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+/* called between sweeps, when no worker holds a pointer into settings */
+int apply_pending_config() {
+    balloon_settings *candidate = __atomic_exchange_n(&pending_settings, NULL, __ATOMIC_ACQ_REL);
+    if (!candidate) return 0;
+
+    settings = *candidate;
+    settings_generation++;
+    free(candidate);
+    vm_cache_resolve_policies();
+    log_msg(LOG_INFO, "config reloaded\n");
+    return 1;
+}
+// ******************** End Config Reload ********************
+
+// ******************** Safety Rails ********************
+/*
+ * Between the controller and the arbiter: a hard floor, no reversal within
+ * cooldown seconds of the last resize, and a token bucket of rate_limit KB of
+ * movement per minute. Giving memory back to a guest in distress skips the
+ * cooldown and may overdraw the bucket, which then refills from below zero.
+ */
+long int memory_floor(const balloon_config *policy, long int max) {
+    return MAX(policy->min_memory, (long int)(policy->min_memory_share * max));
+}
+
+void rails_refill(rail_state *r, const balloon_config *policy, double now) {
+    if (!r->primed) {
+        r->tokens = policy->rate_limit;
+        r->primed = 1;
+    } else {
+        r->tokens = MIN(r->tokens + (now - r->refilled_at) / 60000 * policy->rate_limit, policy->rate_limit);
+    }
+    r->refilled_at = now;
+}
+
+long int apply_rails(rail_state *r, const balloon_config *policy, const vm_info *vm, long int target, double now) {
+    long int move;
+    int direction, urgent;
+
+    target = MAX(target, memory_floor(policy, vm->max));
+    move = target - vm->actual;
+    direction = (move > 0) - (move < 0);
+    urgent = direction > 0 && vm->distress > 0;
+    if (!move) return vm->actual;
+    if (policy->cooldown && r->direction && direction != r->direction && !urgent
+        && now - r->acted_at < policy->cooldown * 1000)
+        return vm->actual;
+    if (policy->rate_limit && !urgent) {
+        rails_refill(r, policy, now);
+        if (labs(move) > r->tokens) move = direction * MAX((long int)r->tokens, 0);
+        /* not worth a resize below the 1MB the guest driver bothers to move */
+        if (labs(move) < 1024) return vm->actual;
+    }
+    return vm->actual + move;
+}
+
+/* a resize of move KB was queued, 1 if it reversed the last one within THRASH_WINDOW */
+int rails_acted(rail_state *r, const balloon_config *policy, long int move, double now) {
+    int direction = (move > 0) - (move < 0);
+    int thrash = r->direction && direction != r->direction && now - r->acted_at < THRASH_WINDOW * 1000;
+
+    if (policy->rate_limit) {
+        rails_refill(r, policy, now);
+        r->tokens -= labs(move);
+    }
+    r->direction = direction;
+    r->acted_at = now;
+    return thrash;
+}
+// ******************** End Safety Rails ********************
+
+// ******************** Host Arbiter ********************
+/* KB of free host memory, from sysinfo() or the fake source given with --host-mem */
+long int read_host_free() {
+    struct sysinfo info;
+    long int free_kb = -1;
+
+    if (host_mem_file) {
+        FILE *file = fopen(host_mem_file, "r");
+        if (file == NULL) return -1;
+        if (fscanf(file, "%ld", &free_kb) != 1) free_kb = -1;
+        fclose(file);
+        return free_kb;
+    }
+    if (sysinfo(&info) < 0) return -1;
+    return (long int)((info.freeram + info.bufferram) * (unsigned long long)info.mem_unit >> 10);
+}
+
+/* growth goes to the highest priority first, then to the most pressured */
+int compare_grow(const void *a, const void *b) {
+    const vm_entry *x = *(vm_entry * const *)a, *y = *(vm_entry * const *)b;
+    if (x->config->priority != y->config->priority) return y->config->priority - x->config->priority;
+    return vm_pressure(&y->vm) > vm_pressure(&x->vm) ? 1 : -1;
+}
+
+/* reclaim starts at the lowest priority, then the least pressured */
+int compare_reclaim(const void *a, const void *b) {
+    return -compare_grow(a, b);
+}
+
+/*
+ * Turn the controllers' targets into a plan that keeps host free memory above
+ * host_min_free. Resizes still in flight are left alone but their remaining
+ * move is charged to the budget, also for VMs that are not due this sweep and
+ * so were not sampled. Shrinks are always granted and fund the growth. If the host
+ * is already below the floor, guests with no action planned each give back up
+ * to one step, never more than half of their free memory, until it is covered.
+ */
+void arbitrate(vm_entry **entries, int n, const balloon_config *config) {
+    static vm_entry *grow[MAX_NUM_OF_VM], *idle[MAX_NUM_OF_VM];
+    long int budget = read_host_free(), want;
+    int i, num_grow = 0, num_idle = 0;
+
+    if (budget < 0) return;     // host state unknown, trust the controllers
+    budget -= config->host_min_free;
+
+    for (i = 0; i < n; i++) {
+        vm_entry *e = entries[i];
+        if (e->pending) {
+            /* sampled: only its remaining move counts; not due: all of a growth, none of a shrink */
+            if (e->vm.actual)
+                budget -= e->pending - e->vm.actual;
+            else
+                budget -= MAX(e->pending - e->pending_from, 0);
+            continue;
+        }
+        if (!e->vm.actual) continue;
+        if (e->target < e->vm.actual)
+            budget += e->vm.actual - e->target;
+        else if (e->target > e->vm.actual)
+            grow[num_grow++] = e;
+        else
+            idle[num_idle++] = e;
+    }
+
+    if (budget < 0) {
+        qsort(idle, num_idle, sizeof(vm_entry *), compare_reclaim);
+        for (i = 0; i < num_idle && budget < 0; i++) {
+            want = MIN(idle[i]->config->speed, idle[i]->vm.available / 2);
+            want = MAX(MIN(want, idle[i]->vm.actual - memory_floor(idle[i]->config, idle[i]->vm.max)), 0);
+            idle[i]->target -= want;
+            budget += want;
+        }
+    }
+
+    qsort(grow, num_grow, sizeof(vm_entry *), compare_grow);
+    for (i = 0; i < num_grow; i++) {
+        want = MIN(grow[i]->target - grow[i]->vm.actual, MAX(budget, 0));
+        grow[i]->target = grow[i]->vm.actual + want;
+        budget -= want;
+    }
+}
+// ******************** End Host Arbiter ********************
+
+/* keep a controller's target inside the domain and policy limits */
+long int clamp_target(const balloon_config *policy, const vm_info *vm, long int target) {
+    long int ceiling = policy->max_memory ? MIN(policy->max_memory, vm->max) : vm->max;
+    if (target <= 0) target = vm->actual;
+    return MAX(MIN(target, ceiling), policy->min_memory);
+}
+
+// ******************** Metrics Exporter ********************
+/*
+ * The control loop renders the OpenMetrics text once per sweep into a back
+ * buffer and swaps it in under a trylock, so a slow scrape costs at most one
+ * skipped publication. Scrapes copy the front buffer and never look at live state.
+ */
+void metrics_printf(metrics_buffer *b, const char *format, ...) {
+    va_list args;
+    size_t cap;
+    char *data;
+    int n;
+
+    if (b->failed) return;
+    for (;;) {
+        va_start(args, format);
+        n = vsnprintf(b->data + b->len, b->cap - b->len, format, args);
+        va_end(args);
+        if (n >= 0 && b->len + n < b->cap) break;
+        cap = b->cap ? 2 * b->cap : 65536;
+        if (n < 0 || !(data = realloc(b->data, cap))) {
+            b->failed = 1;
+            return;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    b->len += n;
+}
+
+void metrics_histogram(metrics_buffer *b, const char *name, const char *labels, const histogram *h) {
+    unsigned long cumulative = 0;
+    int i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        cumulative += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        if (i < HISTOGRAM_BUCKETS - 1)
+            metrics_printf(b, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, labels[0] ? "," : "",
+                histogram_bounds[i], cumulative);
+        else
+            metrics_printf(b, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, labels[0] ? "," : "", cumulative);
+    }
+    metrics_printf(b, "%s_sum%s%s%s %.6f\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+        __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED) / 1e9);
+    metrics_printf(b, "%s_count%s%s%s %lu\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+        __atomic_load_n(&h->count, __ATOMIC_RELAXED));
+}
+
+#define COUNTER(field) __atomic_load_n(&counters.field, __ATOMIC_RELAXED)
+
+void metrics_render(metrics_buffer *b) {
+    const vm_entry *e;
+    int slot, in_flight = 0;
+    char label[2 * MAX_VM_NAME_LENGTH];
+    const char *vm;
+
+    b->len = 0;
+    b->failed = 0;
+    metrics_printf(b, "# TYPE balloon_vms gauge\nballoon_vms %d\n", vm_cache_count);
+    metrics_printf(b, "# TYPE balloon_vm_actual_bytes gauge\n# TYPE balloon_vm_available_bytes gauge\n"
+        "# TYPE balloon_vm_max_bytes gauge\n# TYPE balloon_vm_target_bytes gauge\n# TYPE balloon_vm_pressure gauge\n"
+        "# TYPE balloon_vm_sample_period_seconds gauge\n# TYPE balloon_vm_distress gauge\n"
+        "# TYPE balloon_vm_host_rss_bytes gauge\n# TYPE balloon_vm_host_stall gauge\n");
+    for (slot = 0; slot < MAX_NUM_OF_VM; slot++) {
+        e = &vm_cache[slot];
+        if (!e->dom) continue;
+        in_flight += e->pending != 0;
+        if (!e->shown.actual) continue;
+        vm = escape_quoted(label, sizeof(label), e->name);
+        metrics_printf(b, "balloon_vm_actual_bytes{vm=\"%s\"} %ld\n", vm, e->shown.actual << 10);
+        metrics_printf(b, "balloon_vm_available_bytes{vm=\"%s\"} %ld\n", vm, e->shown.available << 10);
+        metrics_printf(b, "balloon_vm_max_bytes{vm=\"%s\"} %ld\n", vm, e->shown.max << 10);
+        metrics_printf(b, "balloon_vm_target_bytes{vm=\"%s\"} %ld\n", vm, e->shown_target << 10);
+        metrics_printf(b, "balloon_vm_pressure{vm=\"%s\"} %.4f\n", vm, vm_pressure(&e->shown));
+        metrics_printf(b, "balloon_vm_sample_period_seconds{vm=\"%s\"} %ld\n", vm, e->sample_period);
+        metrics_printf(b, "balloon_vm_distress{vm=\"%s\"} %.3f\n", vm, e->shown.distress);
+        if (e->cgroup_stat >= 0)
+            metrics_printf(b, "balloon_vm_host_rss_bytes{vm=\"%s\"} %ld\n", vm, e->shown.rss << 10);
+        if (e->cgroup_pressure >= 0)
+            metrics_printf(b, "balloon_vm_host_stall{vm=\"%s\"} %.4f\n", vm, e->shown.stall);
+    }
+    metrics_printf(b, "# TYPE balloon_inflate counter\nballoon_inflate_total %lu\n", COUNTER(inflates));
+    metrics_printf(b, "# TYPE balloon_deflate counter\nballoon_deflate_total %lu\n", COUNTER(deflates));
+    metrics_printf(b, "# TYPE balloon_inflate_bytes counter\nballoon_inflate_bytes_total %lu\n", COUNTER(inflate_kb) << 10);
+    metrics_printf(b, "# TYPE balloon_deflate_bytes counter\nballoon_deflate_bytes_total %lu\n", COUNTER(deflate_kb) << 10);
+    metrics_printf(b, "# TYPE balloon_resizes_in_flight gauge\nballoon_resizes_in_flight %d\n", in_flight);
+    metrics_printf(b, "# TYPE balloon_resize_timeouts counter\nballoon_resize_timeouts_total %lu\n", COUNTER(resize_timeouts));
+    metrics_printf(b, "# TYPE balloon_resize_failures counter\nballoon_resize_failures_total %lu\n", COUNTER(resize_failures));
+    metrics_printf(b, "# TYPE balloon_samples counter\nballoon_samples_total %lu\n", samples_taken);
+    metrics_printf(b, "# TYPE balloon_thrash counter\nballoon_thrash_total %lu\n", COUNTER(thrashes));
+    metrics_printf(b, "# TYPE balloon_decisions counter\nballoon_decisions_total %lu\n",
+        __atomic_load_n(&decisions, __ATOMIC_RELAXED));
+    if (first_decision_ns)
+        metrics_printf(b, "# TYPE balloon_first_decision_seconds gauge\nballoon_first_decision_seconds %.6f\n",
+            (first_decision_ns - start_ns) / 1e9);
+    metrics_printf(b, "# TYPE balloon_libvirt_calls counter\nballoon_libvirt_calls_total %lu\n",
+        __atomic_load_n(&rpc_count, __ATOMIC_RELAXED));
+    metrics_printf(b, "# TYPE balloon_sweep_duration_seconds histogram\n");
+    metrics_histogram(b, "balloon_sweep_duration_seconds", "", &sweep_histogram);
+    metrics_printf(b, "# TYPE balloon_libvirt_call_duration_seconds histogram\n");
+    metrics_histogram(b, "balloon_libvirt_call_duration_seconds", "", &rpc_histogram);
+    metrics_printf(b, "# EOF\n");
+}
+
+/* called by the control loop after every sweep */
+void metrics_publish(double sweep_ms) {
+    metrics_buffer tmp;
+
+    histogram_observe(&sweep_histogram, sweep_ms);
+    if (!metrics_enabled) return;
+
+    metrics_render(&metrics_back);
+    if (metrics_back.failed) {
+        err_log("[%s] Out of memory rendering the metrics, serving the last ones\n", __func__);
+        return;
+    }
+    if (pthread_mutex_trylock(&metrics_lock)) return;
+    tmp = metrics_front;
+    metrics_front = metrics_back;
+    metrics_back = tmp;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/* "/path" is a Unix socket, anything else a TCP port on localhost */
+int metrics_listen(const char *addr) {
+    struct sockaddr_un un;
+    struct sockaddr_in in;
+    int fd, one = 1;
+
+    if (addr[0] == '/') {
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        snprintf(un.sun_path, sizeof(un.sun_path), "%s", addr);
+        unlink(addr);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) return -1;
+        if (bind(fd, (struct sockaddr *)&un, sizeof(un)) < 0) goto out_close;
+    } else {
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        in.sin_port = htons(atoi(addr));
+        in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) return -1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *)&in, sizeof(in)) < 0) goto out_close;
+    }
+    if (listen(fd, 16) < 0) goto out_close;
+    return fd;
+
+out_close:
+    close(fd);
+    return -1;
+}
+
+/* every request gets the metrics, whatever its path */
+void *metrics_server(void *data) {
+    int fd = (int)(long)data, client;
+    static const char unavailable[] = "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+    metrics_buffer copy = { NULL, 0, 0, 0 };
+    char header[128], request[1024], *grown;
+    struct timeval timeout = { METRICS_CLIENT_TIMEOUT, 0 };
+    ssize_t n, off;
+
+    for (;;) {
+        if ((client = accept(fd, NULL, NULL)) < 0) continue;
+        /* one client at a time, an idle one must not hold up the next scrape */
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (read(client, request, sizeof(request)) < 0) goto next;
+
+        pthread_mutex_lock(&metrics_lock);
+        if (copy.cap < metrics_front.len + 1) {
+            if ((grown = realloc(copy.data, metrics_front.len + 1))) {
+                copy.data = grown;
+                copy.cap = metrics_front.len + 1;
+            }
+        }
+        copy.len = copy.cap > metrics_front.len ? metrics_front.len : 0;
+        if (copy.len) memcpy(copy.data, metrics_front.data, copy.len);
+        pthread_mutex_unlock(&metrics_lock);
+
+        /* nothing rendered yet, or no memory to copy it */
+        if (!copy.len) {
+            n = write(client, unavailable, sizeof(unavailable) - 1);
+            goto next;
+        }
+
+        n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+            "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+            "Content-Length: %zu\r\n\r\n", copy.len);
+        if (write(client, header, n) != n) goto next;
+        for (off = 0; off < (ssize_t)copy.len; off += n)
+            if ((n = write(client, copy.data + off, copy.len - off)) <= 0) break;
+next:
+        close(client);
+    }
+    return NULL;
+}
+
+int start_metrics_server(const char *addr) {
+    pthread_t thread;
+    int fd = metrics_listen(addr);
+
+    if (fd < 0) return -1;
+    metrics_enabled = 1;
+    if (pthread_create(&thread, NULL, metrics_server, (void *)(long)fd)) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+// ******************** End Metrics Exporter ********************
+
+// ******************** Resize Dispatch ********************
+/*
+ * virDomainSetMemory only asks the guest to move its balloon; it can take
+ * seconds to get there. The sampling path queues the resize for a dispatcher
+ * thread with its own connection and marks the VM in flight. No new action is
+ * taken on the VM until a sample shows the balloon within RESIZE_SLACK of the
+ * target, the dispatcher reports a failure or resize_timeout runs out.
+ */
+int resize_submit(vm_entry *e, long int target) {
+    resize_request *req;
+
+    pthread_mutex_lock(&resize_lock);
+    if (resize_head - resize_tail == MAX_NUM_OF_VM) {
+        pthread_mutex_unlock(&resize_lock);
+        return -1;
+    }
+    req = &resize_queue[resize_head++ % MAX_NUM_OF_VM];
+    memcpy(req->uuid, e->uuid, VIR_UUID_BUFLEN);
+    req->slot = e - vm_cache;
+    req->generation = slot_generation[req->slot];
+    req->target = target;
+    req->seq = e->resize_seq = ++resize_seq;
+    pthread_cond_signal(&resize_cond);
+    pthread_mutex_unlock(&resize_lock);
+
+    e->pending = target;
+    e->pending_from = e->vm.actual;
+    e->pending_since = backend_clock_ms();
+    return 0;
+}
+
+/* the dispatcher's handle on req's domain, looked up once per domain and restart */
+void *dispatch_dom(const resize_request *req) {
+    if (dispatch_doms[req->slot] && dispatch_generation[req->slot] == req->generation)
+        return dispatch_doms[req->slot];
+    if (dispatch_doms[req->slot])
+        backend->release(dispatch_doms[req->slot]);
+    dispatch_doms[req->slot] = backend->lookup_uuid(dispatch_connection, req->uuid);
+    dispatch_generation[req->slot] = req->generation;
+    return dispatch_doms[req->slot];
+}
+
+/* let go of the handles of domains that left the cache or restarted since */
+void dispatch_prune() {
+    int slot;
+
+    for (slot = 0; slot < MAX_NUM_OF_VM; slot++)
+        if (dispatch_doms[slot]
+            && dispatch_generation[slot] != __atomic_load_n(&slot_generation[slot], __ATOMIC_ACQUIRE)) {
+            backend->release(dispatch_doms[slot]);
+            dispatch_doms[slot] = NULL;
+        }
+}
+
+void *resize_dispatcher(void *data) {
+    resize_request req;
+    void *dom;
+
+    for (;;) {
+        pthread_mutex_lock(&resize_lock);
+        resize_busy = 0;
+        while (resize_head == resize_tail) {
+            dispatch_prune();
+            pthread_cond_broadcast(&resize_idle);
+            pthread_cond_wait(&resize_cond, &resize_lock);
+        }
+        req = resize_queue[resize_tail++ % MAX_NUM_OF_VM];
+        resize_busy = 1;
+        pthread_mutex_unlock(&resize_lock);
+
+        dom = dispatch_dom(&req);
+        if (!dom || backend->set_memory(dom, req.target) < 0) {
+            err_log("[%s] Failed to resize slot %d to %ldMB\n", __func__, req.slot, req.target >> 10);
+            /* sequence numbers are never reused, a slot taken over by another VM ignores this */
+            __atomic_store_n(&vm_cache[req.slot].resize_failed, req.seq, __ATOMIC_RELEASE);
+            /* the handle may be what failed, the next request looks the domain up again */
+            if (dom) backend->release(dom);
+            dispatch_doms[req.slot] = NULL;
+        }
+    }
+    return NULL;
+}
+
+/* wait until every queued resize has been sent, simulated time must not move under one */
+void resize_drain() {
+    pthread_mutex_lock(&resize_lock);
+    while (resize_head != resize_tail || resize_busy)
+        pthread_cond_wait(&resize_idle, &resize_lock);
+    pthread_mutex_unlock(&resize_lock);
+}
+
+int start_dispatcher(const char *uri) {
+    pthread_t thread;
+
+    dispatch_connection = backend->open(uri);
+    if (dispatch_connection == NULL) return -1;
+    if (pthread_create(&thread, NULL, resize_dispatcher, NULL)) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+/* 1 while the last resize is still moving, it is counted once it lands, fails or times out */
+int resize_in_flight(vm_entry *e, const vm_info *vm, const balloon_config *config) {
+    long int moved;
+
+    if (!e->pending) return 0;
+    if (__atomic_load_n(&e->resize_failed, __ATOMIC_ACQUIRE) == e->resize_seq) {
+        __atomic_add_fetch(&counters.resize_failures, 1, __ATOMIC_RELAXED);
+        e->pending = 0;
+        return 0;
+    }
+    if (labs(vm->actual - e->pending) > RESIZE_SLACK) {
+        if (backend_clock_ms() - e->pending_since < config->resize_timeout * 1000) return 1;
+        log_msg(LOG_WARN, "[%s]: resize to %ldMB timed out at %ldMB\n",
+            e->name, e->pending >> 10, vm->actual >> 10);
+        __atomic_add_fetch(&counters.resize_timeouts, 1, __ATOMIC_RELAXED);
+    }
+
+    moved = vm->actual - e->pending_from;
+    if (moved < 0) {
+        __atomic_add_fetch(&counters.inflates, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&counters.inflate_kb, -moved, __ATOMIC_RELAXED);
+    } else if (moved > 0) {
+        __atomic_add_fetch(&counters.deflates, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&counters.deflate_kb, moved, __ATOMIC_RELAXED);
+    }
+    e->pending = 0;
+    return 0;
+}
+// ******************** End Resize Dispatch ********************
+
+// ******************** Trace ********************
+/*
+ * --trace FILE appends what every decision saw and did to a file of fixed-size
+ * records, one write per sweep. Each run opens with a TRACE_START; a TRACE_VM
+ * names a VM the first time it is traced, followed by TRACE_STATEs if its
+ * controller does not start fresh (restored from a checkpoint), and a
+ * TRACE_CONFIG carries its controller settings whenever they change. TRACE_TICKs refer to both by the
+ * run-local VM number, so a reader can mmap the file and walk it in one pass.
+ */
+void trace_pack_config(trace_config *out, const balloon_config *config) {
+    out->low_threshold = config->low_threshold;
+    out->high_threshold = config->high_threshold;
+    out->target_pressure = config->target_pressure;
+    out->kp = config->kp;
+    out->ki = config->ki;
+    out->kd = config->kd;
+    out->forecast_alpha = config->forecast_alpha;
+    out->forecast_beta = config->forecast_beta;
+    out->speed = config->speed;
+    out->max_step = config->max_step;
+    out->forecast_horizon = config->forecast_horizon;
+    out->min_memory = config->min_memory;
+    out->max_memory = config->max_memory;
+    out->controller = config->controller - controllers;
+    out->priority = config->priority;
+}
+
+/* defaults for everything a trace does not carry */
+void trace_unpack_config(balloon_config *config, const trace_config *in) {
+    default_config(config);
+    config->low_threshold = in->low_threshold;
+    config->high_threshold = in->high_threshold;
+    config->target_pressure = in->target_pressure;
+    config->kp = in->kp;
+    config->ki = in->ki;
+    config->kd = in->kd;
+    config->forecast_alpha = in->forecast_alpha;
+    config->forecast_beta = in->forecast_beta;
+    config->speed = in->speed;
+    config->max_step = in->max_step;
+    config->forecast_horizon = in->forecast_horizon;
+    config->min_memory = in->min_memory;
+    config->max_memory = in->max_memory;
+    if (in->controller < sizeof(controllers) / sizeof(controllers[0]))
+        config->controller = &controllers[in->controller];
+    config->priority = in->priority;
+}
+
+trace_record *trace_emit(int kind, unsigned int vm) {
+    trace_record *r = &trace_buffer[trace_len++];
+    memset(r, 0, sizeof(*r));
+    r->kind = kind;
+    r->vm = vm;
+    return r;
+}
+
+void trace_flush() {
+    const char *p = (const char *)trace_buffer;
+    size_t left = trace_len * sizeof(trace_record);
+    ssize_t n;
+
+    for (; left > 0; p += n, left -= n) {
+        if ((n = write(trace_fd, p, left)) <= 0) {
+            err_log("[%s] Failed to write the trace, tracing stopped\n", __func__);
+            close(trace_fd);
+            trace_fd = -1;
+            break;
+        }
+    }
+    trace_len = 0;
+}
+
+/* open or continue a trace, a record torn by a crash is cut off */
+int trace_open(const char *path) {
+    trace_header header;
+    struct stat st;
+
+    if ((trace_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) return -1;
+    if (fstat(trace_fd, &st) < 0) goto fail;
+    if (st.st_size == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+        header.version = TRACE_VERSION;
+        header.record_size = sizeof(trace_record);
+        if (write(trace_fd, &header, sizeof(header)) != sizeof(header)) goto fail;
+    } else {
+        if (pread(trace_fd, &header, sizeof(header), 0) != sizeof(header)
+            || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+            || header.version != TRACE_VERSION || header.record_size != sizeof(trace_record))
+            goto fail;
+        if (st.st_size % sizeof(trace_record) && ftruncate(trace_fd, st.st_size - st.st_size % sizeof(trace_record)) < 0)
+            goto fail;
+    }
+    trace_emit(TRACE_START, 0)->tick.ts = time(NULL) * 1000L;
+    trace_flush();
+    return trace_fd < 0 ? -1 : 0;
+fail:
+    close(trace_fd);
+    trace_fd = -1;
+    return -1;
+}
+
+/* name e in the trace, with the controller state its next decision starts from unless that is a fresh one */
+void trace_domain(vm_entry *e) {
+    static const controller_state fresh;
+    trace_record *r;
+    size_t off;
+
+    if (trace_len + 1 + sizeof(e->ctrl) / sizeof(r->state.bytes) + 1 > TRACE_BUFFER) trace_flush();
+    e->trace_id = ++trace_num_vms;
+    r = trace_emit(TRACE_VM, e->trace_id);
+    memcpy(r->domain.uuid, e->uuid, VIR_UUID_BUFLEN);
+    snprintf(r->domain.name, sizeof(r->domain.name), "%.*s", (int)sizeof(r->domain.name) - 1, e->name);
+    if (!memcmp(&e->ctrl, &fresh, sizeof(fresh))) return;
+    for (off = 0; off < sizeof(e->ctrl); off += sizeof(r->state.bytes)) {
+        r = trace_emit(TRACE_STATE, e->trace_id);
+        r->state.offset = off;
+        memcpy(r->state.bytes, (const char *)&e->ctrl + off, MIN(sizeof(r->state.bytes), sizeof(e->ctrl) - off));
+    }
+}
+
+/* the VMs taken for this sweep that are new to the trace, named before they are decided on */
+void trace_due(int n) {
+    int i;
+
+    if (trace_fd < 0) return;
+    for (i = 0; i < n; i++)
+        if (!vm_cache[sweep_due[i]].trace_id)
+            trace_domain(&vm_cache[sweep_due[i]]);
+}
+
+/* queue this sweep's record of e, plus its config if it is new to the trace */
+void trace_entry(vm_entry *e, long int ts) {
+    trace_record *r;
+
+    if (trace_fd < 0 || !e->vm.actual) return;
+    if (!e->trace_id) trace_domain(e);
+    if (trace_len + 2 > TRACE_BUFFER) trace_flush();
+    if (e->trace_generation != settings_generation) {
+        e->trace_generation = settings_generation;
+        trace_pack_config(&trace_emit(TRACE_CONFIG, e->trace_id)->config, e->config);
+    }
+
+    r = trace_emit(TRACE_TICK, e->trace_id);
+    r->flags = e->held ? TRACE_IN_FLIGHT : 0;
+    r->tick.ts = ts;
+    r->tick.actual = e->vm.actual;
+    r->tick.available = e->vm.available;
+    r->tick.max = e->vm.max;
+    r->tick.last_update = e->vm.last_update;
+    r->tick.decided = e->decided;
+    r->tick.target = e->target;
+    r->tick.distress = e->vm.distress;
+}
+
+void trace_sweep() {
+    struct timespec ts;
+    int slot;
+
+    if (trace_fd < 0) return;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    for (slot = 0; slot < MAX_NUM_OF_VM; slot++)
+        if (vm_cache[slot].dom)
+            trace_entry(&vm_cache[slot], ts.tv_sec * 1000L + ts.tv_nsec / 1000000);
+    trace_flush();
+}
+
+/* the records of a trace file, mapped read-only; NULL if it is not one */
+const trace_record *trace_map(const char *path, size_t *num_records) {
+    const trace_header *header;
+    struct stat st;
+    void *map;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(trace_header)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    header = map;
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) || header->version != TRACE_VERSION
+        || header->record_size != sizeof(trace_record)) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    *num_records = (st.st_size - sizeof(trace_header)) / sizeof(trace_record);
+    return (const trace_record *)(header + 1);
+}
+// ******************** End Trace ********************
+
+void *entry_dom(vm_entry *e, void *conn) {
+    if (conn == connection) return e->dom;
+    if (!e->shard_dom)
+        e->shard_dom = backend->lookup_uuid(conn, e->uuid);
+    return e->shard_dom;
+}
+
+/*
+ * Swap-in and major-fault rates since the previous fresh sample and the host
+ * stall share, each as a share of its limit; their sum, capped at 1, is how
+ * badly the guest is short. Guest counters that went backwards (a guest
+ * reboot) only restart the baseline.
+ */
+void update_distress(vm_entry *e, vm_info *vm, const balloon_config *config) {
+    double now = vm->last_update ? vm->last_update : backend_clock_ms() / 1000, dt = now - e->stats_at, d = 0;
+
+    if (e->stats_at && dt <= 0) {
+        vm->distress = MIN(e->distress + (config->psi_limit ? vm->stall / config->psi_limit : 0), 1);
+        return;
+    }
+    if (e->stats_at && vm->swap_in >= e->swap_in && vm->major_faults >= e->major_faults) {
+        if (config->swap_in_limit) d += (vm->swap_in - e->swap_in) / dt / config->swap_in_limit;
+        if (config->fault_limit) d += (vm->major_faults - e->major_faults) / dt / config->fault_limit;
+        e->distress = MIN(d, 1);
+    }
+    e->swap_in = vm->swap_in;
+    e->major_faults = vm->major_faults;
+    e->stats_at = now;
+    vm->distress = MIN(e->distress + (config->psi_limit ? vm->stall / config->psi_limit : 0), 1);
+}
+
+/*
+ * Sample one cached domain through conn and let the controller pick a target,
+ * without touching the guest yet. Each entry always lands on the same worker
+ * (its slot decides the shard), so the worker's handle is looked up once.
+ */
+void decide_entry(vm_entry *e, void *conn) {
+    void *dom = entry_dom(e, conn);
+    const balloon_config *policy = e->config;
+    long int growth;
+    vm_info vm;
+    int host;
+
+    memset(&e->vm, 0, sizeof(e->vm));
+    e->decided = e->target = 0;
+    e->held = 0;
+    if (!dom || !e->due) return;
+
+    if (e->bulk) {
+        vm = e->sample;
+    } else {
+        backend->sample(dom, &vm);
+        vm.max = e->max;
+    }
+
+    /* set once per domain and period change instead of once per tick */
+    if (e->period != e->sample_period || (e->bulk && !vm.available)) {
+        backend->set_period(dom, e->sample_period);
+        e->period = e->sample_period;
+    }
+
+    /* guests without MemAvailable: count the page cache as free, faults tell when it is not */
+    if (!vm.available) vm.available = vm.unused + vm.disk_caches;
+    host = cgroup_sample(e, &vm);
+    if (!vm.actual || !vm.available || !vm.max ) return;
+    update_distress(e, &vm, policy);
+    if (resize_in_flight(e, &vm, policy)) {
+        e->vm = vm;
+        e->decided = e->target = e->pending;
+        e->held = 1;
+        return;
+    }
+    /*
+     * Decide on fresh stats only, so an event storm can not step twice on one
+     * sample. While the guest stats are stale a new host reading that shows a
+     * stall or growth still counts: memory QEMU touched since is taken as used.
+     */
+    if (vm.last_update && vm.last_update == e->last_update) {
+        growth = vm.rss - e->fresh_rss;
+        if (!host || (!vm.stall && growth <= RESIZE_SLACK)) return;
+        vm.available = MAX(vm.available + vm.actual - e->fresh_actual - MAX(growth, 0), 1);
+    } else {
+        e->last_update = vm.last_update;
+        e->fresh_rss = vm.rss;
+        e->fresh_actual = vm.actual;
+    }
+
+    e->vm = vm;
+    e->decided = clamp_target(policy, &vm, policy->controller->decide(&e->ctrl, &vm, policy));
+    e->target = apply_rails(&e->rails, policy, &vm, e->decided, backend_clock_ms());
+    adapt_period(e, &vm, policy);
+    __atomic_fetch_add(&decisions, 1, __ATOMIC_RELAXED);
+}
+
+/* queue the decided resize, the guest is never waited on here */
+void apply_entry(vm_entry *e) {
+    vm_info *vm = &e->vm;
+
+    if (!vm->actual) return;
+    e->shown = *vm;
+    e->shown_target = e->target;
+    if (!e->pending && e->target != vm->actual) {
+        if (resize_submit(e, e->target) < 0)
+            err_log("[%s] Resize queue is full, dropped %s\n", __func__, e->name);
+        else if (rails_acted(&e->rails, e->config, e->target - vm->actual, backend_clock_ms()))
+            __atomic_add_fetch(&counters.thrashes, 1, __ATOMIC_RELAXED);
+    }
+
+    log_tick(e->name, vm, e->target);
+}
+
+/* run the current phase on every cached VM whose slot falls in this shard */
+void balloon_shard(void *conn, int index, int step) {
+    int slot;
+    for (slot = index; slot < MAX_NUM_OF_VM; slot += step) {
+        if (!vm_cache[slot].dom) continue;
+        if (sweep_phase == PHASE_DECIDE)
+            decide_entry(&vm_cache[slot], conn);
+        else
+            apply_entry(&vm_cache[slot]);
+    }
+}
+
+void *worker_thread(void *data) {
+    balloon_worker *worker = data;
+    for (;;) {
+        pthread_barrier_wait(&sweep_start);
+        balloon_shard(worker->connection, worker->index, num_workers);
+        pthread_barrier_wait(&sweep_done);
+    }
+    return NULL;
+}
+
+int start_workers(const char *uri, int n) {
+    int i;
+    if (n > MAX_NUM_OF_WORKER) n = MAX_NUM_OF_WORKER;
+    pthread_barrier_init(&sweep_start, NULL, n + 1);
+    pthread_barrier_init(&sweep_done, NULL, n + 1);
+
+    for (i = 0; i < n; i++) {
+        workers[i].index = i;
+        workers[i].connection = backend->open(uri);
+        if (workers[i].connection == NULL) {
+            err_log("[%s] Failed to open connection for worker %d\n", __func__, i);
+            return -1;
+        }
+    }
+    num_workers = n;
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i])) {
+            err_log("[%s] Failed to start worker %d\n", __func__, i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* bring the cache in line with the running domains, looking up only new ones */
+void sync_vm_cache() {
+    vm_entry *e;
+    void *dom;
+    int i;
+
+    sweep_generation++;
+    if (bulk_stats && backend->sample_all) {
+        sweep_num_VMs = backend->sample_all(connection, sweep_doms, sweep_samples, MAX_NUM_OF_VM);
+        for (i = 0; i < sweep_num_VMs; i++) {
+            if (!(e = vm_cache_insert(sweep_doms[i]))) continue;
+            e->sample = sweep_samples[i];
+            e->bulk = 1;
+            e->seen = sweep_generation;
+        }
+    } else {
+        sweep_num_VMs = backend->list(connection, sweep_vm_ids, MAX_NUM_OF_VM);
+        for (i = 0; i < sweep_num_VMs; i++) {
+            if (!(e = vm_cache_find_id(sweep_vm_ids[i]))) {
+                if (!(dom = backend->lookup_id(connection, sweep_vm_ids[i]))) continue;
+                if (!(e = vm_cache_insert(dom))) continue;
+            }
+            e->bulk = 0;
+            e->seen = sweep_generation;
+        }
+    }
+    if (sweep_num_VMs >= 0)
+        vm_cache_evict_stale();
+}
+
+void run_phase(int phase) {
+    sweep_phase = phase;
+    if (num_workers) {
+        pthread_barrier_wait(&sweep_start);
+        pthread_barrier_wait(&sweep_done);
+    } else {
+        balloon_shard(connection, 0, 1);
+    }
+}
+
+void arbitrate_all(const balloon_config *config) {
+    static vm_entry *entries[MAX_NUM_OF_VM];
+    int slot, n = 0;
+
+    for (slot = 0; slot < MAX_NUM_OF_VM; slot++)
+        if (vm_cache[slot].dom)
+            entries[n++] = &vm_cache[slot];
+    arbitrate(entries, n, config);
+}
+
+/* decide and apply on the VMs that are due, or on all of them */
+void balloon_due(int all) {
+    double now = backend_clock_ms();
+    int n = schedule_take(all ? INFINITY : now);
+
+    samples_taken += n;
+    trace_due(n);
+    run_phase(PHASE_DECIDE);
+    arbitrate_all(&settings.global);
+    run_phase(PHASE_APPLY);
+    trace_sweep();
+    schedule_requeue(n, now);
+}
+
+/* one pass over the running domains, returns its wall time in ms */
+double sweep(int all) {
+    double start = now_ms();
+
+    sync_vm_cache();
+    if (vm_cache_count > 0)
+        balloon_due(all);
+    return now_ms() - start;
+}
+
+/* sleep until the next VM is due or a stop is requested, a simulator moves its clock instead */
+void wait_next() {
+    long int ms = schedule_wait_ms(backend_clock_ms());
+    struct pollfd wake = { .fd = wake_fd, .events = POLLIN };
+
+    if (backend->advance) {
+        resize_drain();
+        backend->advance(ms);
+    } else if (!stop_requested()) {
+        /* waking early only reruns a sweep with nothing due */
+        if (watchdog_interval_ms())
+            ms = MIN(ms, watchdog_interval_ms());
+        poll(&wake, wake_fd >= 0, ms);
+    }
+}
+
+/* the housekeeping every sweep ends with, in both loops */
+void after_sweep(double elapsed) {
+    metrics_publish(elapsed);
+    note_first_decision();
+    checkpoint_tick();
+}
+
+void ballooning() {
+    double elapsed;
+    int ready = 0;
+
+    while (!stop_requested()) {
+        apply_pending_config();
+        elapsed = sweep(0);
+        after_sweep(elapsed);
+        if (!ready++) {
+            checkpoint_release();
+            notify_systemd("READY=1\nSTATUS=Ballooning %d VMs", vm_cache_count);
+        }
+        log_msg(LOG_DEBUG, "sweep: %d VMs in %.3fms (%d workers)\n",
+            vm_cache_count, elapsed, num_workers);
+        wait_next();
+        watchdog_ping();
+    }
+}
+
+/*
+ * Control-loop cost of the per-VM tick line: the old formatted fprintf against
+ * handing a record to the async writer. Records go out in half-ring batches
+ * and the drain between batches is not timed, so nothing is dropped.
+ */
+void log_benchmark(int records) {
+    vm_info vm = { .actual = 3 << 20, .available = 1 << 20, .max = 4 << 20 };
+    FILE *null = fopen("/dev/null", "w");
+    double start, sync_ms, async_ms = 0;
+    int i, j;
+
+    if (null == NULL) return;
+    start = now_ms();
+    for (i = 0; i < records; i++)
+        fprintf(null, "[%s]: used:%ldMB | free: %ldMB | current: %ldMB | max: %ldMB | pressure: %.2f%%\n",
+            "bench", (vm.actual - vm.available) >> 10, vm.available >> 10, vm.actual >> 10, vm.max >> 10,
+            vm_pressure(&vm) * 100);
+    fflush(null);
+    sync_ms = now_ms() - start;
+
+    __atomic_store_n(&log_out, null, __ATOMIC_RELEASE);
+    log_level = LOG_INFO;
+    for (i = 0; i < records; i += LOG_RING_SIZE / 2) {
+        start = now_ms();
+        for (j = i; j < records && j < i + LOG_RING_SIZE / 2; j++)
+            log_tick("bench", &vm, vm.actual);
+        async_ms += now_ms() - start;
+        log_flush();
+    }
+    log_level = LOG_WARN;
+    __atomic_store_n(&log_out, stdout, __ATOMIC_RELEASE);
+
+    fprintf(stdout, "logging:   fprintf %.0fns/record | async %.0fns/record\n",
+        sync_ms * 1e6 / records, async_ms * 1e6 / records);
+}
+
+/* run back-to-back sweeps through the per-domain and the bulk path */
+void benchmark(int rounds) {
+    int mode, i;
+    double total;
+    unsigned long rpcs;
+
+    log_level = LOG_WARN;
+    log_benchmark(MIN(rounds, 100) * 1000);     // simulator runs take thousands of rounds
+    for (mode = 0; mode < 2; mode++) {
+        bulk_stats = mode;
+        total = 0;
+        rpcs = rpc_count;
+        for (i = 0; i < rounds && !stop_requested(); i++) {
+            /* a simulator runs on its schedule, real time does not pass here */
+            total += sweep(!backend->advance);
+            if (backend->advance) wait_next();
+        }
+        fprintf(stdout, "%-10s %d VMs | %.1f RPCs/sweep | %.3fms/sweep\n",
+            mode ? "bulk:" : "per-domain:", vm_cache_count,
+            (double)(rpc_count - rpcs) / MAX(i, 1), total / MAX(i, 1));
+        if (backend->report)
+            backend->report(stdout);
+    }
+}
+
+// ******************** Event Mode ********************
+/* libvirt only: the callbacks hand out virDomainPtr, which is that backend's domain handle */
+
+/* the timer only runs while there is something to balloon */
+void update_tick_timer() {
+    virEventUpdateTimeout(tick_timer, vm_cache_count ? schedule_wait_ms(now_ms()) : -1);
+}
+
+int on_lifecycle(virConnectPtr conn, virDomainPtr dom, int event, int detail, void *opaque) {
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    vm_entry *e;
+
+    switch (event) {
+    case VIR_DOMAIN_EVENT_STARTED:
+    case VIR_DOMAIN_EVENT_RESUMED:
+        virDomainRef(dom);
+        vm_cache_insert(dom);
+        break;
+    case VIR_DOMAIN_EVENT_STOPPED:
+    case VIR_DOMAIN_EVENT_SHUTDOWN:
+    case VIR_DOMAIN_EVENT_CRASHED:
+        if (virDomainGetUUID(dom, uuid) == 0 && (e = vm_cache_find_uuid(uuid)))
+            vm_cache_remove(e);
+        break;
+    }
+    update_tick_timer();
+    return 0;
+}
+
+void on_balloon_change(virConnectPtr conn, virDomainPtr dom, unsigned long long actual, void *opaque) {
+    unsigned char uuid[VIR_UUID_BUFLEN];
+    double start = now_ms();
+    vm_entry *e;
+
+    if (virDomainGetUUID(dom, uuid) < 0 || !(e = vm_cache_find_uuid(uuid))) return;
+
+    /* out of schedule, the VM keeps its place in the heap */
+    if (trace_fd >= 0 && !e->trace_id)
+        trace_domain(e);
+    e->due = 1;
+    decide_entry(e, connection);
+    arbitrate(&e, 1, &settings.global);
+    apply_entry(e);
+    e->due = 0;
+    if (trace_fd >= 0) {
+        trace_entry(e, time(NULL) * 1000L);
+        trace_flush();
+    }
+    log_msg(LOG_INFO, "[%s]: balloon changed to %lluMB, reacted in %.3fms\n",
+        e->name, actual >> 10, now_ms() - start);
+}
+
+void on_tick(int timer, void *opaque) {
+    double start = now_ms();
+
+    apply_pending_config();
+    balloon_due(0);
+    update_tick_timer();
+    after_sweep(now_ms() - start);
+    log_msg(LOG_DEBUG, "sweep: %d VMs in %.3fms (events)\n", vm_cache_count, now_ms() - start);
+}
+
+/* the tick timer is off while no VM runs, the watchdog still has to hear from us */
+void on_watchdog(int timer, void *opaque) {
+    watchdog_ping();
+}
+
+void ballooning_events() {
+    virDomainPtr *doms = NULL;
+    int i, n;
+
+    tick_timer = virEventAddTimeout(-1, on_tick, NULL, NULL);
+    if (watchdog_interval_ms())
+        virEventAddTimeout(watchdog_interval_ms(), on_watchdog, NULL, NULL);
+
+    virConnectDomainEventRegisterAny(connection, NULL, VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+        VIR_CONNECT_DOMAIN_EVENT_CALLBACK(on_lifecycle), NULL, NULL);
+    virConnectDomainEventRegisterAny(connection, NULL, VIR_DOMAIN_EVENT_ID_BALLOON_CHANGE,
+        VIR_CONNECT_DOMAIN_EVENT_CALLBACK(on_balloon_change), NULL, NULL);
+
+    n = RPC(virConnectListAllDomains(connection, &doms, VIR_CONNECT_LIST_DOMAINS_ACTIVE));
+    for (i = 0; i < n; i++)
+        vm_cache_insert(doms[i]);
+    free(doms);
+    checkpoint_release();
+    update_tick_timer();
+    notify_systemd("READY=1\nSTATUS=Ballooning %d VMs (events)", vm_cache_count);
+
+    while (!stop_requested()) {
+        if (virEventRunDefaultImpl() < 0) {
+            err_log("[%s] Event loop failed\n", __func__);
+            break;
+        }
+    }
+}
+// ******************** End Event Mode ********************
+
+// ******************** Replay ********************
+/*
+ * Offline harness for the controllers. A trace is either a binary --trace file
+ * or one "name used_kb max_kb" line per VM per tick. Binary traces are first
+ * replayed as recorded: every decision is rerun with its recorded config and
+ * must come out the same. Then every policy is run against the same demand,
+ * with the guest modelled as available = actual - used and resizes landing by
+ * the next tick.
+ */
+typedef struct {
+    char name[MAX_VM_NAME_LENGTH];
+    long int max;
+    long int *used;
+    int num_ticks, cap;
+    balloon_config config;      // the VM's policy, the controller is swapped per run
+} replay_vm;
+
+typedef struct {
+    char name[MAX_VM_NAME_LENGTH];
+    balloon_config config;
+    controller_state ctrl;
+} reproduce_vm;
+
+typedef struct {
+    long int ticks, high_ticks, segments, unconverged;
+    double converge_ticks, overshoot, moved;
+} replay_result;
+
+void replay_push(replay_vm *rvm, long int used, long int max) {
+    if (rvm->num_ticks == rvm->cap) {
+        rvm->cap = rvm->cap ? 2 * rvm->cap : 64;
+        rvm->used = realloc(rvm->used, rvm->cap * sizeof(long int));
+    }
+    rvm->used[rvm->num_ticks++] = used;
+    rvm->max = max;
+}
+
+/* grow a per-run table indexed by trace VM number, new slots are zeroed */
+void *trace_table(void *table, size_t *cap, size_t size, unsigned int vm) {
+    size_t n = *cap;
+    if (vm < n) return table;
+    *cap = MAX(MAX(2 * n, (size_t)vm + 1), 256);
+    table = realloc(table, *cap * size);
+    memset((char *)table + n * size, 0, (*cap - n) * size);
+    return table;
+}
+
+/* demand of every traced VM, one replay_vm per VM per run */
+int load_binary_trace(const trace_record *records, size_t num_records, replay_vm *vms) {
+    const trace_record *r;
+    int *series = NULL, n = 0, i;
+    size_t cap = 0, k;
+
+    for (k = 0; k < num_records; k++) {
+        r = &records[k];
+        if (r->kind == TRACE_START) {
+            memset(series, 0, cap * sizeof(int));
+            continue;
+        }
+        series = trace_table(series, &cap, sizeof(int), r->vm);
+        if (r->kind == TRACE_VM && !series[r->vm] && n < MAX_NUM_OF_VM) {
+            memset(&vms[n], 0, sizeof(vms[n]));
+            snprintf(vms[n].name, sizeof(vms[n].name), "%s", r->domain.name);
+            default_config(&vms[n].config);
+            series[r->vm] = ++n;    // 0 is untracked
+        }
+        if (!(i = series[r->vm])) continue;
+        if (r->kind == TRACE_CONFIG)
+            trace_unpack_config(&vms[i - 1].config, &r->config);
+        else if (r->kind == TRACE_TICK)
+            replay_push(&vms[i - 1], r->tick.actual - r->tick.available, r->tick.max);
+    }
+    free(series);
+    return n;
+}
+
+/* rerun every recorded decision from the recorded inputs, config and starting state, counting the ones that differ */
+void trace_reproduce(const trace_record *records, size_t num_records) {
+    const trace_record *r;
+    reproduce_vm *vms = NULL, *v;
+    unsigned long samples = 0, decisions = 0, mismatches = 0, start = now_ns(), elapsed;
+    size_t cap = 0, k;
+    long int target;
+    vm_info vm;
+
+    memset(&vm, 0, sizeof(vm));
+    for (k = 0; k < num_records; k++) {
+        r = &records[k];
+        if (r->kind == TRACE_START) {
+            memset(vms, 0, cap * sizeof(*vms));
+            continue;
+        }
+        vms = trace_table(vms, &cap, sizeof(*vms), r->vm);
+        v = &vms[r->vm];
+        if (r->kind == TRACE_VM) {
+            snprintf(v->name, sizeof(v->name), "%s", r->domain.name);
+        } else if (r->kind == TRACE_CONFIG) {
+            trace_unpack_config(&v->config, &r->config);
+        } else if (r->kind == TRACE_STATE) {
+            /* a VM resumed from a checkpoint, its controller goes on from there */
+            if (r->state.offset < sizeof(v->ctrl))
+                memcpy((char *)&v->ctrl + r->state.offset, r->state.bytes,
+                    MIN(sizeof(r->state.bytes), sizeof(v->ctrl) - r->state.offset));
+        } else if (r->kind == TRACE_TICK) {
+            samples++;
+            if ((r->flags & TRACE_IN_FLIGHT) || !v->config.controller) continue;
+            vm.actual = r->tick.actual;
+            vm.available = r->tick.available;
+            vm.max = r->tick.max;
+            vm.last_update = r->tick.last_update;
+            vm.distress = r->tick.distress;
+            target = clamp_target(&v->config, &vm, v->config.controller->decide(&v->ctrl, &vm, &v->config));
+            decisions++;
+            if (target != r->tick.decided && !mismatches++)
+                fprintf(stdout, "first mismatch: %s at %ld, recorded %ldMB, replayed %ldMB\n",
+                    v->name, (long int)r->tick.ts, (long int)(r->tick.decided >> 10), target >> 10);
+        }
+    }
+    elapsed = now_ns() - start;
+    fprintf(stdout, "reproduce: %lu samples | %lu decisions | %lu differ | %.1fM samples/s\n",
+        samples, decisions, mismatches, elapsed ? samples * 1e3 / elapsed : 0);
+    free(vms);
+}
+
+int load_trace(const char *path, replay_vm *vms) {
+    char line[256], name[MAX_VM_NAME_LENGTH];
+    long int used, max;
+    int n = 0, i, last = 0;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return -1;
+
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || sscanf(line, "%63s %ld %ld", name, &used, &max) != 3) continue;
+        /* consecutive lines usually belong to consecutive VMs */
+        for (i = last; i < n && strcmp(vms[i].name, name); i++);
+        if (i == n)
+            for (i = 0; i < n && strcmp(vms[i].name, name); i++);
+        if (i == n) {
+            if (n == MAX_NUM_OF_VM) continue;
+            memset(&vms[n], 0, sizeof(vms[n]));
+            snprintf(vms[n].name, sizeof(vms[n].name), "%s", name);
+            n++;
+        }
+        replay_push(&vms[i], used, max);
+        last = (i + 1) % (n ? n : 1);
+    }
+    fclose(file);
+    return n;
+}
+
+/* a new segment starts whenever demand jumps by more than 5% of max */
+void replay_one(const replay_vm *rvm, const balloon_config *config, replay_result *res) {
+    controller_state state;
+    vm_info vm;
+    long int target;
+    int t, start = 0, settled = 0;
+    float pressure, excess;
+
+    memset(&state, 0, sizeof(state));
+    memset(&vm, 0, sizeof(vm));
+    vm.max = rvm->max;
+    vm.actual = rvm->max;
+    res->segments++;
+
+    for (t = 0; t < rvm->num_ticks; t++) {
+        if (t && labs(rvm->used[t] - rvm->used[t - 1]) * 20 > rvm->max) {
+            if (!settled) res->unconverged++;
+            res->segments++;
+            start = t;
+            settled = 0;
+        }
+        vm.available = MAX(vm.actual - rvm->used[t], 0);
+        pressure = vm_pressure(&vm);
+        res->ticks++;
+        if (pressure >= config->high_threshold) res->high_ticks++;
+
+        if (pressure >= config->low_threshold && pressure < config->high_threshold) {
+            if (!settled) res->converge_ticks += t - start;
+            settled = 1;
+        } else if (settled) {
+            excess = pressure < config->low_threshold ? config->low_threshold - pressure
+                                                      : pressure - config->high_threshold;
+            if (excess > res->overshoot) res->overshoot = excess;
+        }
+
+        target = clamp_target(config, &vm, config->controller->decide(&state, &vm, config));
+        if (target != vm.actual) {
+            res->moved += labs(target - vm.actual);
+            vm.actual = target;
+        }
+    }
+    if (!settled) res->unconverged++;
+}
+
+void replay(const char *path) {
+    static replay_vm vms[MAX_NUM_OF_VM];
+    const trace_record *records;
+    balloon_config config;
+    replay_result res;
+    size_t c, num_records;
+    int n, i;
+
+    if ((records = trace_map(path, &num_records))) {
+        trace_reproduce(records, num_records);
+        n = load_binary_trace(records, num_records, vms);
+    } else {
+        if ((n = load_trace(path, vms)) < 0) {
+            fprintf(stderr, "Failed to read trace %s\n", path);
+            return;
+        }
+        if (load_config(&settings, 0) < 0)
+            fprintf(stderr, "No usable %s, replaying with the default config\n", CONFIG_FILE);
+        for (i = 0; i < n; i++)
+            vms[i].config = *resolve_policy(&settings, vms[i].name, "", "");
+    }
+
+    fprintf(stdout, "%-10s %5s %8s %10s %11s %10s %10s %10s\n", "policy", "VMs", "ticks",
+        "converge", "unconverged", "overshoot", "high-ticks", "moved");
+    for (c = 0; c < sizeof(controllers) / sizeof(controllers[0]); c++) {
+        memset(&res, 0, sizeof(res));
+        for (i = 0; i < n; i++) {
+            config = vms[i].config;
+            config.controller = &controllers[c];
+            replay_one(&vms[i], &config, &res);
+        }
+        fprintf(stdout, "%-10s %5d %8ld %8.1f t %11ld %9.1f%% %10ld %7.0f MB\n",
+            controllers[c].name, n, res.ticks,
+            res.segments > res.unconverged ? res.converge_ticks / (res.segments - res.unconverged) : 0,
+            res.unconverged, res.overshoot * 100, res.high_ticks, res.moved / 1024);
+    }
+    for (i = 0; i < n; i++)
+        free(vms[i].used);
+}
+// ******************** End Replay ********************
+
+void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -c, --connect URI   hypervisor connection URI (default " DEFAULT_URI "),\n"
+        "                      sim://N[/SEED] simulates N guests in process\n"
+        "  -w, --workers N     shard each sweep across N threads, one connection each\n"
+        "  -b, --bulk          fetch all balloon stats with one GetAllDomainStats per sweep\n"
+        "  -e, --events        track domains through lifecycle/balloon events instead of polling\n"
+        "      --bench N       run N sweeps per stats path and report RPCs and latency\n"
+        "      --host-mem FILE read host free memory (KB) from FILE instead of sysinfo()\n"
+        "      --cgroup-root DIR  read VM cgroups below DIR (default " CGROUP_ROOT " with libvirt)\n"
+        "      --checkpoint FILE  keep per-VM controller state in FILE across restarts\n"
+        "                      (default " CHECKPOINT_FILE ", \"\" turns it off)\n"
+        "      --trace FILE    append every decision's inputs and outputs to a binary trace\n"
+        "      --replay FILE   rerun a --trace file as recorded, then run every controller\n"
+        "                      offline on its (or a text trace's) demand and compare\n"
+        "      --metrics ADDR  serve OpenMetrics on a Unix socket (/path) or localhost TCP port\n"
+        "      --profile       time every libvirt call site, dump p50/p99/max on SIGUSR1 and at exit\n"
+        "      --log-level L   error, warn, info (default, per-VM JSON records) or debug\n"
+        "  -h, --help          show this help\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *uri = DEFAULT_URI;
+    const char *metrics_addr = NULL, *trace_path = NULL;
+    int n_workers = 0, bench_rounds = 0, opt, i;
+    sigset_t mask;
+
+    /* before anything can log: records claimed earlier would never be seen */
+    log_init();
+    start_ns = now_ns();
+    static struct option long_options[] = {
+        {"connect", required_argument, 0, 'c'},
+        {"workers", required_argument, 0, 'w'},
+        {"bulk",    no_argument,       0, 'b'},
+        {"events",  no_argument,       0, 'e'},
+        {"bench",   required_argument, 0, 'B'},
+        {"replay",  required_argument, 0, 'R'},
+        {"host-mem", required_argument, 0, 'M'},
+        {"cgroup-root", required_argument, 0, 'G'},
+        {"checkpoint", required_argument, 0, 'K'},
+        {"log-level", required_argument, 0, 'L'},
+        {"metrics", required_argument, 0, 'P'},
+        {"profile", no_argument,       0, 'p'},
+        {"trace",   required_argument, 0, 'T'},
+        {"help",    no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "c:w:beh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c': uri = optarg; break;
+        case 'w': n_workers = atoi(optarg); break;
+        case 'b': bulk_stats = 1; break;
+        case 'e': event_mode = 1; break;
+        case 'B': bench_rounds = atoi(optarg); break;
+        case 'R': replay(optarg); return 0;
+        case 'M': host_mem_file = optarg; break;
+        case 'G': cgroup_root = optarg; break;
+        case 'K': checkpoint_path = optarg; break;
+        case 'P': metrics_addr = optarg; break;
+        case 'p': profiling = 1; break;
+        case 'T': trace_path = optarg; break;
+        case 'L':
+            for (i = LOG_ERROR; i <= LOG_DEBUG && strcmp(log_level_names[i], optarg); i++);
+            if (i > LOG_DEBUG) { usage(argv[0]); return 1; }
+            log_level = i;
+            break;
+        case 'h': usage(argv[0]); return 0;
+        default:  usage(argv[0]); return 1;
+        }
+    }
+
+    /* SIGHUP, SIGUSR1, SIGTERM and SIGINT are only read by the config watcher, block them before any thread exists */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    create_file_if_not_exist();
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (start_log_writer() < 0) {
+        fprintf(stderr, "Failed to start the log writer\n");
+        return 1;
+    }
+    if (bench_rounds > 0)
+        checkpoint_path = NULL;
+    else if (!checkpoint_path && make_dir(STATE_DIR) == 0)
+        checkpoint_path = CHECKPOINT_FILE;
+    if (checkpoint_path && !*checkpoint_path)
+        checkpoint_path = NULL;
+    load_config(&settings, 1);
+    vm_cache_init();
+    checkpoint_load();
+    if (trace_path && trace_open(trace_path) < 0) {
+        fprintf(stderr, "Failed to open trace %s\n", trace_path);
+        return 1;
+    }
+    if (start_config_watcher() < 0)
+        err_log("[%s] Failed to start the config watcher\n", __func__);
+    if (metrics_addr && start_metrics_server(metrics_addr) < 0) {
+        fprintf(stderr, "Failed to serve metrics on %s\n", metrics_addr);
+        return 1;
+    }
+
+    if (event_mode && virEventRegisterDefaultImpl() < 0) {
+        fprintf(stderr, "Failed to register the libvirt event loop\n");
+        return 1;
+    }
+
+    backend = find_backend(uri);
+    if (event_mode && backend != &libvirt_backend) {
+        fprintf(stderr, "Event mode needs a libvirt connection\n");
+        return 1;
+    }
+    if (!cgroup_root && backend == &libvirt_backend)
+        cgroup_root = CGROUP_ROOT;
+    connection = backend->open(uri);
+    if (connection == NULL) {
+        fprintf(stderr, "Failed to open connection to the hypervisor\n");
+        return 1;
+    }
+
+    if (start_dispatcher(uri) < 0) {
+        fprintf(stderr, "Failed to start the resize dispatcher\n");
+        return 1;
+    }
+
+    if (n_workers > 0 && !event_mode && start_workers(uri, n_workers) < 0) {
+        fprintf(stderr, "Failed to start worker pool\n");
         return 1;
     }
 
-    ballooning();
+    if (bench_rounds > 0)
+        benchmark(bench_rounds);
+    else if (event_mode)
+        ballooning_events();
+    else
+        ballooning();
 
-    virConnectClose(connection);
+    /* let queued resizes go out, then remember them as in flight */
+    notify_systemd("STOPPING=1");
+    resize_drain();
+    checkpoint_save();
+    backend->close(connection);
+    if (profiling)
+        profile_dump();
+    log_flush();
 
     return 0;
 }
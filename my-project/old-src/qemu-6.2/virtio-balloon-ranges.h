@@ -0,0 +1,60 @@
+/*
+ * Coalescing of balloon PFN lists into contiguous ranges
+ *
+ * Shared by virtio-balloon.c and balloon-bench.c, so it only needs
+ * <stdint.h> and <stdlib.h>.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.
+ */
+
+#ifndef VIRTIO_BALLOON_RANGES_H
+#define VIRTIO_BALLOON_RANGES_H
+
+typedef struct BalloonRange {
+    uint64_t pfn;       /* first PFN of the range */
+    uint64_t pages;     /* length in PFNs */
+} BalloonRange;
+
+static int balloon_pfn_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Sort @pfns in place and merge them into @ranges, which must have room
+ * for @n entries. Each PFN covers @stride PFNs (one chunk); a PFN that
+ * starts where the previous range ends extends it, one that falls inside
+ * it (a duplicate) is dropped. Returns the number of ranges.
+ */
+static inline size_t balloon_coalesce(uint32_t *pfns, size_t n,
+                                      uint64_t stride, BalloonRange *ranges)
+{
+    size_t i, nr = 0;
+
+    qsort(pfns, n, sizeof(*pfns), balloon_pfn_cmp);
+
+    for (i = 0; i < n; i++) {
+        if (nr) {
+            BalloonRange *last = &ranges[nr - 1];
+            uint64_t end = last->pfn + last->pages;
+
+            if (pfns[i] == end) {
+                last->pages += stride;
+                continue;
+            }
+            if (pfns[i] < end) {
+                continue;
+            }
+        }
+        ranges[nr].pfn = pfns[i];
+        ranges[nr].pages = stride;
+        nr++;
+    }
+    return nr;
+}
+
+#endif
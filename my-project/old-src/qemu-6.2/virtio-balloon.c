@@ -2,6 +2,8 @@
 #include "qemu/iov.h"
 #include "qemu/module.h"
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
 #include "hw/virtio/virtio.h"
 #include "hw/mem/pc-dimm.h"
 #include "hw/qdev-properties.h"
@@ -18,25 +20,38 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
+#include "virtio-balloon-ranges.h"
+
 #define BALLOON_PAGE_SIZE  (1 << VIRTIO_BALLOON_PFN_SHIFT)
 
+/* PFNs name 2 MB aligned chunks instead of 4 KiB pages */
+#define VIRTIO_BALLOON_F_HUGE_PAGES 6
+#define BALLOON_HUGE_PAGE_SIZE (1 << 21)
+
+/* PFNs read and coalesced at a time, one 32 MB batch of the driver */
+#define BALLOON_PFN_CHUNK 8192
+/* Largest element accepted, 4 GB worth of 4 KiB PFNs */
+#define BALLOON_MAX_PFNS (1 << 20)
+
 
 static void balloon_deflate_page(VirtIOBalloon *balloon,
-                                 MemoryRegion *mr, hwaddr mr_offset)
+                                 MemoryRegion *mr, hwaddr mr_offset,
+                                 size_t size)
 {
     void *addr = memory_region_get_ram_ptr(mr) + mr_offset;
     ram_addr_t rb_offset;
     RAMBlock *rb;
     size_t rb_page_size;
-    void *host_addr;
+    uintptr_t start, end;
     int ret;
 
     rb = qemu_ram_block_from_host(addr, false, &rb_offset);
     rb_page_size = qemu_ram_pagesize(rb);
 
-    host_addr = (void *)((uintptr_t)addr & ~(rb_page_size - 1));
+    start = QEMU_ALIGN_DOWN((uintptr_t)addr, rb_page_size);
+    end = QEMU_ALIGN_UP((uintptr_t)addr + size, rb_page_size);
 
-    ret = qemu_madvise(host_addr, rb_page_size, QEMU_MADV_WILLNEED);
+    ret = qemu_madvise((void *)start, end - start, QEMU_MADV_WILLNEED);
     if (ret != 0) {
         warn_report("Couldn't MADV_WILLNEED on balloon deflate: %s",
                     strerror(errno));
@@ -44,89 +59,288 @@ static void balloon_deflate_page(VirtIOBalloon *balloon,
 }
 
 static void balloon_inflate_page(
-    VirtIOBalloon *balloon, MemoryRegion *mr, hwaddr mr_offset)
+    VirtIOBalloon *balloon, MemoryRegion *mr, hwaddr mr_offset, size_t size)
 {
     void *addr = memory_region_get_ram_ptr(mr) + mr_offset;
-    ram_addr_t rb_offset;
+    ram_addr_t rb_offset, start, end;
     RAMBlock *rb;
     size_t rb_page_size;
 
     rb = qemu_ram_block_from_host(addr, false, &rb_offset);
     rb_page_size = qemu_ram_pagesize(rb);
 
-    ram_block_discard_range(rb, rb_offset, rb_page_size);
+    /* only whole host pages can be given back, a 4 KiB chunk of a huge
+     * page frees nothing */
+    start = QEMU_ALIGN_UP(rb_offset, rb_page_size);
+    end = QEMU_ALIGN_DOWN(rb_offset + size, rb_page_size);
+    if (start < end) {
+        ram_block_discard_range(rb, start, end - start);
+    }
+}
+
+/* A RAM section to inflate or deflate; holds a reference on its region */
+typedef struct BalloonSection {
+    MemoryRegion *mr;
+    hwaddr offset;
+    uint64_t size;
+} BalloonSection;
+
+struct BalloonWork {
+    VirtQueue *vq;
+    VirtQueueElement *elem;
+    GArray *sections;
+    QSIMPLEQ_ENTRY(BalloonWork) next;
+};
+
+/* Collect every RAM section inside [pa, pa + size) */
+static void balloon_resolve_range(GArray *sections, hwaddr pa, uint64_t size)
+{
+    MemoryRegionSection section;
+
+    while (size) {
+        hwaddr end;
+
+        section = memory_region_find(get_system_memory(), pa, size);
+        if (!section.mr) break;
+
+        end = section.offset_within_address_space +
+              int128_get64(section.size);
+
+        if (memory_region_is_ram(section.mr) &&
+            !memory_region_is_rom(section.mr) &&
+            !memory_region_is_romd(section.mr)) {
+            BalloonSection b = {
+                .mr = section.mr,
+                .offset = section.offset_within_region,
+                .size = int128_get64(section.size),
+            };
+            g_array_append_val(sections, b);
+        } else {
+            memory_region_unref(section.mr);
+        }
+
+        size -= end - pa;
+        pa = end;
+    }
+}
+
+static void balloon_work_free(BalloonWork *work)
+{
+    guint i;
+
+    for (i = 0; i < work->sections->len; i++) {
+        memory_region_unref(g_array_index(work->sections, BalloonSection, i).mr);
+    }
+    g_array_free(work->sections, true);
+    g_free(work->elem);
+    g_free(work);
+}
+
+static void *balloon_worker(void *opaque)
+{
+    VirtIOBalloon *s = opaque;
+    BalloonWork *work;
+    guint i;
+
+    rcu_register_thread();
+    qemu_mutex_lock(&s->work_lock);
+    for (;;) {
+        while (QSIMPLEQ_EMPTY(&s->work_queue) && !s->worker_stop) {
+            qemu_cond_wait(&s->work_cond, &s->work_lock);
+        }
+        if (s->worker_stop) break;
+
+        work = QSIMPLEQ_FIRST(&s->work_queue);
+        QSIMPLEQ_REMOVE_HEAD(&s->work_queue, next);
+        s->work_running = work;
+        qemu_mutex_unlock(&s->work_lock);
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            for (i = 0; i < work->sections->len; i++) {
+                BalloonSection *b = &g_array_index(work->sections,
+                                                   BalloonSection, i);
+
+                if (work->vq == s->ivq || work->vq == s->reporting_vq) {
+                    balloon_inflate_page(s, b->mr, b->offset, b->size);
+                } else if (work->vq == s->dvq) {
+                    balloon_deflate_page(s, b->mr, b->offset, b->size);
+                } else {
+                    g_assert_not_reached();
+                }
+            }
+        }
+
+        qemu_mutex_lock(&s->work_lock);
+        s->work_running = NULL;
+        QSIMPLEQ_INSERT_TAIL(&s->done_queue, work, next);
+        qemu_cond_broadcast(&s->work_cond);
+        qemu_bh_schedule(s->done_bh);
+    }
+    qemu_mutex_unlock(&s->work_lock);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Complete finished elements; drop them instead when the rings are gone */
+static void balloon_work_complete(VirtIOBalloon *s, bool push)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    QSIMPLEQ_HEAD(, BalloonWork) done = QSIMPLEQ_HEAD_INITIALIZER(done);
+    BalloonWork *work;
+
+    qemu_mutex_lock(&s->work_lock);
+    QSIMPLEQ_CONCAT(&done, &s->done_queue);
+    qemu_mutex_unlock(&s->work_lock);
+
+    while ((work = QSIMPLEQ_FIRST(&done))) {
+        QSIMPLEQ_REMOVE_HEAD(&done, next);
+        if (push) {
+            virtqueue_push(work->vq, work->elem, 0);
+            virtio_notify(vdev, work->vq);
+        }
+        balloon_work_free(work);
+    }
+}
+
+static void balloon_work_done_bh(void *opaque)
+{
+    balloon_work_complete(opaque, true);
+}
+
+/* Wait until the worker has finished everything queued so far */
+static void balloon_work_flush(VirtIOBalloon *s, bool push)
+{
+    if (!s->done_bh) return;   /* worker already stopped */
+
+    qemu_mutex_lock(&s->work_lock);
+    while (!QSIMPLEQ_EMPTY(&s->work_queue) || s->work_running) {
+        qemu_cond_wait(&s->work_cond, &s->work_lock);
+    }
+    qemu_mutex_unlock(&s->work_lock);
+
+    balloon_work_complete(s, push);
+}
+
+static BalloonWork *balloon_work_new(VirtQueue *vq, VirtQueueElement *elem,
+                                     size_t reserve)
+{
+    BalloonWork *work = g_new0(BalloonWork, 1);
+
+    work->vq = vq;
+    work->elem = elem;
+    work->sections = g_array_sized_new(false, false, sizeof(BalloonSection),
+                                       reserve);
+    return work;
+}
+
+/* Hand resolved sections to the worker; the element is pushed back from
+ * done_bh */
+static void balloon_work_queue(VirtIOBalloon *s, BalloonWork *work)
+{
+    qemu_mutex_lock(&s->work_lock);
+    QSIMPLEQ_INSERT_TAIL(&s->work_queue, work, next);
+    qemu_cond_signal(&s->work_cond);
+    qemu_mutex_unlock(&s->work_lock);
 }
 
 static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
     VirtQueueElement *elem;
-    MemoryRegionSection section;
+    size_t chunk = virtio_vdev_has_feature(vdev, VIRTIO_BALLOON_F_HUGE_PAGES) ?
+                   BALLOON_HUGE_PAGE_SIZE : BALLOON_PAGE_SIZE;
+    uint32_t stride = chunk >> VIRTIO_BALLOON_PFN_SHIFT;
+    uint32_t *pfns = g_new(uint32_t, BALLOON_PFN_CHUNK);
+    BalloonRange *ranges = g_new(BalloonRange, BALLOON_PFN_CHUNK);
 
     for (;;) {
-        size_t offset = 0;
-        uint32_t pfn;
+        size_t i, n, off, len, nr;
+        BalloonWork *work;
 
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem)  break;
 
-        while (iov_to_buf(elem->out_sg, elem->out_num, offset, &pfn, 4) == 4) {
-            unsigned int p = virtio_ldl_p(vdev, &pfn);
-            hwaddr pa;
+        n = iov_size(elem->out_sg, elem->out_num) / 4;
+        if (n > BALLOON_MAX_PFNS) {
+            virtio_error(vdev, "balloon element of %zu PFNs is too large", n);
+            virtqueue_detach_element(vq, elem, 0);
+            g_free(elem);
+            break;
+        }
 
-            pa = (hwaddr) p << VIRTIO_BALLOON_PFN_SHIFT;
-            offset += 4;
+        /* one memory_region_find and one discard per contiguous range
+         * instead of per PFN; the guest sizes the element, so it is read
+         * and coalesced BALLOON_PFN_CHUNK PFNs at a time. Resolve here
+         * under the BQL, discard on the worker. */
+        work = balloon_work_new(vq, elem, 0);
+        for (off = 0; off < n; off += len) {
+            len = MIN(n - off, BALLOON_PFN_CHUNK);
+            iov_to_buf(elem->out_sg, elem->out_num, off * 4, pfns, len * 4);
 
-            section = memory_region_find(get_system_memory(), pa,
-                                         BALLOON_PAGE_SIZE);
-            if (!section.mr) continue;
+            for (i = 0, nr = 0; i < len; i++) {
+                uint32_t p = virtio_ldl_p(vdev, &pfns[i]);
 
-            if (!memory_region_is_ram(section.mr) ||
-                memory_region_is_rom(section.mr) ||
-                memory_region_is_romd(section.mr)) {
-                memory_region_unref(section.mr);
-                continue;
+                if (p % stride) continue;
+                pfns[nr++] = p;
             }
+            nr = balloon_coalesce(pfns, nr, stride, ranges);
 
-            if (vq == s->ivq) {
-                balloon_inflate_page(s, section.mr,
-                                        section.offset_within_region);
-            } else if (vq == s->dvq) {
-                balloon_deflate_page(s, section.mr, section.offset_within_region);
-            } else {
-                g_assert_not_reached();
+            for (i = 0; i < nr; i++) {
+                balloon_resolve_range(work->sections,
+                                      (hwaddr) ranges[i].pfn << VIRTIO_BALLOON_PFN_SHIFT,
+                                      ranges[i].pages << VIRTIO_BALLOON_PFN_SHIFT);
             }
-
-            memory_region_unref(section.mr);
         }
 
-        virtqueue_push(vq, elem, 0);
-        virtio_notify(vdev, vq);
-        g_free(elem);
+        balloon_work_queue(s, work);
     }
+
+    g_free(ranges);
+    g_free(pfns);
 }
 
-static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
+/*
+ * Free page reports: each buffer is a free block of at least 2 MB that the
+ * guest keeps in its free lists. Only the host memory behind it is
+ * discarded, the guest faults in zero pages when it reuses the block.
+ */
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
     VirtQueueElement *elem;
-    uint64_t stat[2];
-    size_t offset = 0;
 
-    elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
-    if (!elem) return;
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        BalloonWork *work = balloon_work_new(vq, elem, elem->in_num);
+        unsigned int i;
 
-    if (s->stats_vq_elem != NULL) {
-        g_free(s->stats_vq_elem);
+        for (i = 0; i < elem->in_num; i++) {
+            balloon_resolve_range(work->sections, elem->in_addr[i],
+                                  elem->in_sg[i].iov_len);
+        }
+        balloon_work_queue(s, work);
     }
+}
 
-    s->stats_vq_elem = elem;
-    while (iov_to_buf(elem->out_sg, elem->out_num, offset, &stat, sizeof(stat))
-           == sizeof(stat)) {
-        uint64_t memfree = virtio_tswap64(vdev, stat[0]);
-        uint64_t memtotal = virtio_tswap64(vdev, stat[1]);
-        offset += sizeof(stat);
-        fprintf(stdout, "mem_free %lu, mem_total %lu", memfree, memtotal);
+static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtQueueElement *elem;
+    uint64_t stat[2];
+
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        size_t offset = 0;
+
+        while (iov_to_buf(elem->out_sg, elem->out_num, offset, &stat, sizeof(stat))
+               == sizeof(stat)) {
+            uint64_t memfree = virtio_tswap64(vdev, stat[0]);
+            uint64_t memtotal = virtio_tswap64(vdev, stat[1]);
+            offset += sizeof(stat);
+            fprintf(stdout, "mem_free %lu, mem_total %lu", memfree, memtotal);
+        }
+
+        /* hand the buffer back, the guest only has one in flight */
+        virtqueue_push(vq, elem, 0);
+        virtio_notify(vdev, vq);
+        g_free(elem);
     }
 }
 
@@ -140,6 +354,19 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     s->ivq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
+    if (virtio_has_feature(s->host_features, VIRTIO_BALLOON_F_REPORTING)) {
+        s->reporting_vq = virtio_add_queue(vdev, 32,
+                                           virtio_balloon_handle_report);
+    }
+
+    qemu_mutex_init(&s->work_lock);
+    qemu_cond_init(&s->work_cond);
+    QSIMPLEQ_INIT(&s->work_queue);
+    QSIMPLEQ_INIT(&s->done_queue);
+    s->done_bh = qemu_bh_new(balloon_work_done_bh, s);
+    s->worker_stop = false;
+    qemu_thread_create(&s->worker, "balloon-worker", balloon_worker, s,
+                       QEMU_THREAD_JOINABLE);
 }
 
 static void virtio_balloon_device_unrealize(DeviceState *dev)
@@ -147,9 +374,23 @@ static void virtio_balloon_device_unrealize(DeviceState *dev)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
 
+    balloon_work_flush(s, false);
+    qemu_mutex_lock(&s->work_lock);
+    s->worker_stop = true;
+    qemu_cond_signal(&s->work_cond);
+    qemu_mutex_unlock(&s->work_lock);
+    qemu_thread_join(&s->worker);
+    qemu_bh_delete(s->done_bh);
+    s->done_bh = NULL;
+    qemu_cond_destroy(&s->work_cond);
+    qemu_mutex_destroy(&s->work_lock);
+
     virtio_delete_queue(s->ivq);
     virtio_delete_queue(s->dvq);
     virtio_delete_queue(s->svq);
+    if (s->reporting_vq) {
+        virtio_delete_queue(s->reporting_vq);
+    }
 
     virtio_cleanup(vdev);
 }
@@ -158,6 +399,8 @@ static void virtio_balloon_device_reset(VirtIODevice *vdev)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
 
+    balloon_work_flush(s, false);
+
     if (s->stats_vq_elem != NULL) {
         virtqueue_unpop(s->svq, s->stats_vq_elem, 0);
         g_free(s->stats_vq_elem);
@@ -173,13 +416,20 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
 static uint64_t virtio_balloon_get_features(VirtIODevice *vdev, uint64_t f,
                                             Error **errp)
 {
-    return 0;
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+
+    return f | s->host_features;
 }
 
 static void virtio_balloon_set_status(VirtIODevice *vdev, uint8_t status)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
 
+    /* nothing may be in flight once the VM stops, e.g. for migration */
+    if (!vdev->vm_running) {
+        balloon_work_flush(s, true);
+    }
+
     if (!s->stats_vq_elem && vdev->vm_running &&
         (status & VIRTIO_CONFIG_S_DRIVER_OK) && virtqueue_rewind(s->svq, 1)) {
         /* poll stats queue for the element we have discarded when the VM
@@ -217,6 +467,10 @@ static const VMStateDescription vmstate_virtio_balloon = {
 };
 
 static Property virtio_balloon_properties[] = {
+    DEFINE_PROP_BIT("huge-pages", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_HUGE_PAGES, false),
+    DEFINE_PROP_BIT("free-page-reporting", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_REPORTING, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -8,9 +8,13 @@
 #include <linux/module.h>
 #include <linux/cgroup.h>
 #include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/scatterlist.h>
 #include <linux/freezer.h>
 #include <linux/virtio_ids.h>
 #include <linux/vmpressure.h>
+#include <linux/page_reporting.h>
 #include <linux/virtio_config.h>
 #include <linux/balloon_compaction.h>
 
@@ -18,12 +22,22 @@
 
 #define VIRTIO_BALLOON_PAGES_PER_32MB (32 << 8)
 
+/* A batch is split into one descriptor per page of the PFN buffer; the extra
+ * entry covers a buffer that does not start on a page boundary. */
+#define VIRTIO_BALLOON_PFNS_PER_SG (PAGE_SIZE / sizeof(__virtio32))
+#define VIRTIO_BALLOON_MAX_SG \
+    (DIV_ROUND_UP(VIRTIO_BALLOON_PAGES_PER_32MB, VIRTIO_BALLOON_PFNS_PER_SG) + 1)
+
 
 struct virtio_balloon 
 {
     struct virtio_device *vdev;
     struct balloon_dev_info *balloon_dev_info;
     struct virt_channel *stats_channel, *inflate_channel, *deflate_channel;
+    struct virt_channel *reporting_channel;
+
+    /* Free page reporting, registered when the device has a reporting queue */
+    struct page_reporting_dev_info pr_dev_info;
 
     /* The thread servicing the balloon. */
 	struct task_struct *thread;
@@ -34,7 +48,24 @@ struct virtio_balloon
     // Number of balloon pages give to host
     unsigned int num_pages;
 
+    /* Order of a balloon chunk, non-zero with VIRTIO_BALLOON_F_HUGE_PAGES.
+     * Huge chunks are not movable, so they stay off balloon_dev_info. */
+    unsigned int chunk_order;
+    struct list_head huge_pages;
+
     u64 stats[2];
+
+    /* The one stats buffer given to the host, rewritten only once it is
+     * back; stats above always hold the latest sample. */
+    u64 stats_msg[2];
+    bool stats_in_flight;
+
+    /* PFNs of the batch being sent, 32 bit as the device reads them */
+    __virtio32 *pfns;
+
+    /* Inflate throughput since probe */
+    u64 inflated_bytes;
+    u64 inflate_ns;
 };
 
 
@@ -48,7 +79,7 @@ static void callback(struct virtqueue *vq) {
     ack(channel);
 }
 
-struct virt_channel *create_virt_channel(struct virtio_device *vdev, char *name) {
+struct virt_channel *create_virt_channel(struct virtqueue *vq) {
     struct virt_channel *channel;
 
     if (!(channel = kzalloc(sizeof(struct virt_channel), GFP_KERNEL))) 
@@ -56,43 +87,51 @@ struct virt_channel *create_virt_channel(struct virtio_device *vdev, char *name)
     if (!(channel->ack = kzalloc(sizeof(wait_queue_head_t), GFP_KERNEL))) 
         goto out;
 
-    channel->vq = virtio_find_single_vq(vdev, callback, name);
-    if (IS_ERR(channel->vq)) 
-        goto out_free_ack;
-
+    channel->vq = vq;
     channel->vq->priv = channel;
     init_waitqueue_head(channel->ack);
     return channel;
 
-out_free_ack:
-    kfree(channel->ack);
 out:
     kfree(channel);
     return NULL;
 };
 
+/* Buffers belong to the device struct, only detach them */
 void free_channel_buf(struct virt_channel *channel) {
-    void *buf;
-    while ((buf = virtqueue_detach_unused_buf(channel->vq)) != NULL) {
-        kfree(buf);
-    }
+    while (virtqueue_detach_unused_buf(channel->vq) != NULL)
+        ;
 }
 
-void channel_send(struct virt_channel *channel, void *message) {
+/* Queue `len` bytes as one descriptor chain, one entry per page of the
+ * message, so a whole batch costs a single kick. */
+void channel_send(struct virt_channel *channel, void *message, size_t len) {
     struct virtqueue *vq = channel->vq;
-    struct scatterlist sg;
+    struct scatterlist sg[VIRTIO_BALLOON_MAX_SG];
+    unsigned int nents = 0;
 
-	sg_init_one(&sg, message, sizeof(message));
-	if (virtqueue_add_outbuf(vq, &sg, 1, channel, GFP_KERNEL) < 0)
+    sg_init_table(sg, VIRTIO_BALLOON_MAX_SG);
+    while (len && nents < VIRTIO_BALLOON_MAX_SG) {
+        size_t chunk = min_t(size_t, len, PAGE_SIZE - offset_in_page(message));
+
+        sg_set_buf(&sg[nents++], message, chunk);
+        message += chunk;
+        len -= chunk;
+    }
+    BUG_ON(len || !nents);
+    sg_mark_end(&sg[nents - 1]);
+
+	if (virtqueue_add_outbuf(vq, sg, nents, channel, GFP_KERNEL) < 0)
         BUG();
 	virtqueue_kick(vq);
 };
 
 /* will sleep until receive ack */
-void channel_send_and_wait_ack(struct virt_channel *channel, void *message) {
-    unsigned int len;
-    channel_send(channel, message);
-    wait_event(*channel->ack, virtqueue_get_buf(channel->vq, &len));
+void channel_send_and_wait_ack(struct virt_channel *channel, void *message,
+                               size_t len) {
+    unsigned int used;
+    channel_send(channel, message, len);
+    wait_event(*channel->ack, virtqueue_get_buf(channel->vq, &used));
 };
 
 // *** Update Stats ***
@@ -101,60 +140,115 @@ void channel_send_and_wait_ack(struct virt_channel *channel, void *message) {
 static void update_stats(struct virtio_balloon *vb)
 {
 	struct sysinfo i;
+    unsigned int used;
 	si_meminfo(&i);
 
     vb->stats[0] = pages_to_bytes(i.freeram);
     vb->stats[1] = pages_to_bytes(i.totalram);
 
     printk(KERN_WARNING "mem_free %lu, mem_total %lu", vb->stats[0], vb->stats[1]);
-    channel_send(vb->stats_channel, vb->stats);
+
+    while (virtqueue_get_buf(vb->stats_channel->vq, &used))
+        vb->stats_in_flight = false;
+    if (vb->stats_in_flight)
+        return;
+
+    memcpy(vb->stats_msg, vb->stats, sizeof(vb->stats_msg));
+    vb->stats_in_flight = true;
+    channel_send(vb->stats_channel, vb->stats_msg, sizeof(vb->stats_msg));
 }
 // *** End Update Stats ***
 
 
-static unsigned long *pages_to_pfn_array(struct list_head *head, size_t len) {
-    size_t i = 0;
-    unsigned long pfns[len];
-    struct page *page, *tmp;
+// The device takes 4 KiB frame numbers, checked in probe
+static inline __virtio32 page_to_balloon_pfn(struct virtio_balloon *vb,
+                                             struct page *page) {
+    return cpu_to_virtio32(vb->vdev, page_to_pfn(page));
+}
 
-    list_for_each_entry_safe(page, tmp, head, lru) {
-		list_del(&page->lru);
-		pfns[i++] = page_to_pfn(page);
-	}
+// *** Balloon Chunk ***
+static struct page *balloon_chunk_alloc(struct virtio_balloon *vb) {
+    if (!vb->chunk_order)
+        return balloon_page_alloc();
+    return alloc_pages(GFP_HIGHUSER | __GFP_NOMEMALLOC | __GFP_NORETRY |
+                       __GFP_NOWARN, vb->chunk_order);
+}
+
+static void balloon_chunk_enqueue(struct virtio_balloon *vb, struct page *page) {
+    if (!vb->chunk_order)
+        balloon_page_enqueue(vb->balloon_dev_info, page);
+    else
+        list_add(&page->lru, &vb->huge_pages);
+}
+
+static size_t balloon_chunk_dequeue(struct virtio_balloon *vb,
+                                    struct list_head *pages, size_t n) {
+    size_t i;
+
+    if (!vb->chunk_order)
+        return balloon_page_list_dequeue(vb->balloon_dev_info, pages, n);
+    for (i = 0; i < n && !list_empty(&vb->huge_pages); i++)
+        list_move(vb->huge_pages.next, pages);
+    return i;
+}
+
+static void balloon_chunk_free(struct virtio_balloon *vb, struct page *page) {
+    if (!vb->chunk_order)
+        put_page(page);
+    else
+        __free_pages(page, vb->chunk_order);
+}
+// *** End Balloon Chunk ***
 
-    return pfns;
+// *** Inflate Throughput ***
+static u64 mb_per_sec(u64 bytes, u64 ns) {
+    return ns ? div64_u64((bytes >> 10) * NSEC_PER_SEC, ns) >> 10 : 0;
 }
 
+static void account_inflate(struct virtio_balloon *vb, size_t pages, ktime_t start)
+{
+    u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    vb->inflated_bytes += pages_to_bytes(pages);
+    vb->inflate_ns += ns;
+
+    printk(KERN_INFO "inflate %zu pages in %llu us, %llu MB/s (%llu MB/s total)",
+           pages, ns / NSEC_PER_USEC, mb_per_sec(pages_to_bytes(pages), ns),
+           mb_per_sec(vb->inflated_bytes, vb->inflate_ns));
+}
+// *** End Inflate Throughput ***
+
 // *** Balloon Func ***
 
 static void inflate_balloon(struct virtio_balloon *vb){
     if (mutex_is_locked( &(vb->page_mutex) )) return;
 
-    struct list_head pages;
-    INIT_LIST_HEAD(&pages);
     size_t num_enqueued = 0;
+    bool out_of_memory = false;
+    ktime_t start = ktime_get();
 
     mutex_lock(&vb->page_mutex);
     unsigned int i;
-    for (i=0 ; i<VIRTIO_BALLOON_PAGES_PER_32MB ; i++) {
-        struct page *balloon_page = balloon_page_alloc();
+    for (i=0 ; i<(VIRTIO_BALLOON_PAGES_PER_32MB >> vb->chunk_order) ; i++) {
+        struct page *balloon_page = balloon_chunk_alloc(vb);
         if (!balloon_page) {
-            msleep(200);
+            out_of_memory = true;
 			break;
         }
-        balloon_page_enqueue(vb->balloon_dev_info, balloon_page);
-        list_add(&balloon_page->lru, &pages);
-        num_enqueued++;
+        balloon_chunk_enqueue(vb, balloon_page);
+        vb->pfns[num_enqueued++] = page_to_balloon_pfn(vb, balloon_page);
     }
 
     if (num_enqueued) {
-        channel_send_and_wait_ack(
-            vb->inflate_channel,
-            pages_to_pfn_array(&pages, num_enqueued)
-        );
-        vb->num_pages += num_enqueued;
+        channel_send_and_wait_ack(vb->inflate_channel, vb->pfns,
+                                  num_enqueued * sizeof(vb->pfns[0]));
+        vb->num_pages += num_enqueued << vb->chunk_order;
+        account_inflate(vb, num_enqueued << vb->chunk_order, start);
     }
     mutex_unlock(&vb->page_mutex);
+
+    if (out_of_memory)
+        msleep(200);
 }
 
 static void deflate_balloon(struct virtio_balloon *vb){
@@ -163,18 +257,28 @@ static void deflate_balloon(struct virtio_balloon *vb){
     mutex_lock(&vb->page_mutex);
     struct list_head pages;
     INIT_LIST_HEAD(&pages);
-    size_t num_dequeued = balloon_page_list_dequeue(
-        vb->balloon_dev_info,
+    size_t num_dequeued = balloon_chunk_dequeue(
+        vb,
         &pages,
-        VIRTIO_BALLOON_PAGES_PER_32MB
+        VIRTIO_BALLOON_PAGES_PER_32MB >> vb->chunk_order
     );
 
     if (num_dequeued) {
-        channel_send_and_wait_ack(
-            vb->deflate_channel,
-            pages_to_pfn_array(&pages, num_dequeued)
-        );
-        vb->num_pages -= num_dequeued;
+        struct page *page, *tmp;
+        size_t i = 0;
+
+        list_for_each_entry(page, &pages, lru)
+            vb->pfns[i++] = page_to_balloon_pfn(vb, page);
+
+        /* the host must know before the guest reuses the pages */
+        channel_send_and_wait_ack(vb->deflate_channel, vb->pfns,
+                                  i * sizeof(vb->pfns[0]));
+        vb->num_pages -= num_dequeued << vb->chunk_order;
+
+        list_for_each_entry_safe(page, tmp, &pages, lru) {
+            list_del(&page->lru);
+            balloon_chunk_free(vb, page);
+        }
     }
     mutex_unlock(&vb->page_mutex);
 }
@@ -199,6 +303,35 @@ static int ballooning(void *data)
 }
 // *** End Balloon Func ***
 
+// *** Free Page Reporting ***
+static inline bool reporting_enabled(struct virtio_device *vdev) {
+    return IS_ENABLED(CONFIG_PAGE_REPORTING) &&
+           virtio_has_feature(vdev, VIRTIO_BALLOON_F_REPORTING);
+}
+
+/* Called by mm with free blocks of at least pageblock_order (2 MB on x86)
+ * that stay isolated until we return. The host discards them, the guest
+ * keeps them in its free lists. */
+static int report_free_pages(struct page_reporting_dev_info *pr_dev_info,
+                             struct scatterlist *sg, unsigned int nents)
+{
+    struct virtio_balloon *vb =
+        container_of(pr_dev_info, struct virtio_balloon, pr_dev_info);
+    struct virt_channel *channel = vb->reporting_channel;
+    unsigned int used;
+    int err;
+
+    /* one report at a time, the queue is always empty here */
+    err = virtqueue_add_inbuf(channel->vq, sg, nents, channel,
+                              GFP_NOWAIT | __GFP_NOWARN);
+    if (WARN_ON_ONCE(err))
+        return err;
+    virtqueue_kick(channel->vq);
+    wait_event(*channel->ack, virtqueue_get_buf(channel->vq, &used));
+    return 0;
+}
+// *** End Free Page Reporting ***
+
 // ******************** End Utils ********************
 
 
@@ -207,6 +340,17 @@ static int virtio_balloon_probe(struct virtio_device *vdev)
     printk(KERN_WARNING"driver in init\n");
     int err = -1;
     struct virtio_balloon *vb = NULL;
+    struct virtqueue *vqs[VIRTIO_BALLOON_VQ_MAX];
+    vq_callback_t *callbacks[VIRTIO_BALLOON_VQ_MAX] = {
+        callback, callback, callback, callback
+    };
+    /* a NULL name skips the queue without taking its index */
+    const char *names[VIRTIO_BALLOON_VQ_MAX] = {
+        "inflate_channel", "deflate_channel", "stats_channel",
+        reporting_enabled(vdev) ? "reporting_channel" : NULL
+    };
+
+    BUILD_BUG_ON(PAGE_SHIFT != VIRTIO_BALLOON_PFN_SHIFT);
 
     if (!(vb = kzalloc(sizeof(struct virtio_balloon), GFP_KERNEL)))
         return -ENOMEM;
@@ -218,30 +362,64 @@ static int virtio_balloon_probe(struct virtio_device *vdev)
 
     balloon_devinfo_init(vb->balloon_dev_info);
 
+    vb->pfns = kmalloc_array(VIRTIO_BALLOON_PAGES_PER_32MB, sizeof(vb->pfns[0]),
+                             GFP_KERNEL);
+    if (!vb->pfns) {
+        err = -ENOMEM;
+        goto out_free_dev_info;
+    }
+
+    /* all queues in one call, each virtio_find_single_vq would claim queue 0 */
+    err = virtio_find_vqs(vdev, VIRTIO_BALLOON_VQ_MAX, vqs, callbacks, names, NULL);
+    if (err)
+        goto out_free_pfns;
+
+    err = -ENOMEM;
     if (
-           !(vb->stats_channel =   create_virt_channel(vdev, "stats_channel"))
-        || !(vb->inflate_channel = create_virt_channel(vdev, "inflate_channel"))
-        || !(vb->deflate_channel = create_virt_channel(vdev, "deflate_channel"))
+           !(vb->inflate_channel = create_virt_channel(vqs[VIRTIO_BALLOON_VQ_INFLATE]))
+        || !(vb->deflate_channel = create_virt_channel(vqs[VIRTIO_BALLOON_VQ_DEFLATE]))
+        || !(vb->stats_channel =   create_virt_channel(vqs[VIRTIO_BALLOON_VQ_STATS]))
     ) goto out_del_vqs;
-
-    vb->thread = kthread_run(ballooning, vb, "ballooning");
-	if (IS_ERR(vb->thread)) {
-		err = PTR_ERR(vb->thread);
-		goto out_del_vqs;
-	}
+    if (reporting_enabled(vdev) &&
+        !(vb->reporting_channel = create_virt_channel(vqs[VIRTIO_BALLOON_VQ_REPORTING])))
+        goto out_del_vqs;
 
     mutex_init(&(vb->page_mutex));
     vb->num_pages = 0;
     vb->vdev = vdev;
     vdev->priv = vb;
 
+    INIT_LIST_HEAD(&vb->huge_pages);
+    if (virtio_has_feature(vdev, VIRTIO_BALLOON_F_HUGE_PAGES))
+        vb->chunk_order = VIRTIO_BALLOON_HUGE_PAGE_SHIFT - PAGE_SHIFT;
+
     /* from this point on, the vdev can notify and get callbacks */
     virtio_device_ready(vdev);
 
+    if (reporting_enabled(vdev)) {
+        vb->pr_dev_info.report = report_free_pages;
+        err = page_reporting_register(&vb->pr_dev_info);
+        if (err)
+            goto out_reset;
+    }
+
+    vb->thread = kthread_run(ballooning, vb, "ballooning");
+	if (IS_ERR(vb->thread)) {
+		err = PTR_ERR(vb->thread);
+		goto out_unregister;
+	}
+
     return 0;
 
+out_unregister:
+    if (reporting_enabled(vdev))
+        page_reporting_unregister(&vb->pr_dev_info);
+out_reset:
+    vdev->config->reset(vdev);
 out_del_vqs:
 	vdev->config->del_vqs(vdev);
+out_free_pfns:
+    kfree(vb->pfns);
 out_free_dev_info:
     kfree(vb->balloon_dev_info);
 out_free_vb:
@@ -256,6 +434,8 @@ static void virtio_balloon_remove(struct virtio_device *vdev)
     printk(KERN_WARNING"driver in exit\n");
     struct virtio_balloon *vb = vdev->priv;
 
+    if (reporting_enabled(vdev))
+        page_reporting_unregister(&vb->pr_dev_info);
     /* stop all ballooning thread */
     kthread_stop(vb->thread);
     /* free all pages left in the balloon */
@@ -265,8 +445,11 @@ static void virtio_balloon_remove(struct virtio_device *vdev)
     free_channel_buf(vb->stats_channel);
     free_channel_buf(vb->inflate_channel);
     free_channel_buf(vb->deflate_channel);
+    if (vb->reporting_channel)
+        free_channel_buf(vb->reporting_channel);
     virtio_break_device(vdev);
     vdev->config->del_vqs(vdev);
+    kfree(vb->pfns);
     kfree(vb->balloon_dev_info);
     kfree(vb);
 }
@@ -277,11 +460,20 @@ static const struct virtio_device_id id_table[] = {
     { 0 },
 };
 
+static unsigned int features[] = {
+    VIRTIO_BALLOON_F_HUGE_PAGES,
+#ifdef CONFIG_PAGE_REPORTING
+    VIRTIO_BALLOON_F_REPORTING,
+#endif
+};
+
 
 static struct virtio_driver virtio_balloon_driver = {
     .driver.name =    "VirtIO Balloon Driver",
     .driver.owner =   THIS_MODULE,
     .id_table =       id_table,
+    .feature_table =  features,
+    .feature_table_size = ARRAY_SIZE(features),
     .probe =          virtio_balloon_probe, 
     .remove =         virtio_balloon_remove
 };
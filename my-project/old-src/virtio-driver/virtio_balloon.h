@@ -9,9 +9,25 @@
 /* Size of a PFN in the balloon interface. */
 #define VIRTIO_BALLOON_PFN_SHIFT 12
 
+/* Feature bits */
+#define VIRTIO_BALLOON_F_REPORTING  5 /* Free page reporting queue */
+#define VIRTIO_BALLOON_F_HUGE_PAGES 6 /* PFNs name 2 MB aligned chunks */
+
+/* Size of a chunk when VIRTIO_BALLOON_F_HUGE_PAGES is negotiated. */
+#define VIRTIO_BALLOON_HUGE_PAGE_SHIFT 21
+
 #define VIRTIO_BALLOON_S_MEMFREE  0   /* Total amount of free memory */
 #define VIRTIO_BALLOON_S_MEMTOT   1   /* Total amount of memory */
 
+/* Virtqueue order, must match the order the device adds its queues in. */
+enum virtio_balloon_vq {
+    VIRTIO_BALLOON_VQ_INFLATE,
+    VIRTIO_BALLOON_VQ_DEFLATE,
+    VIRTIO_BALLOON_VQ_STATS,
+    VIRTIO_BALLOON_VQ_REPORTING,    /* only with VIRTIO_BALLOON_F_REPORTING */
+    VIRTIO_BALLOON_VQ_MAX
+};
+
 struct virt_channel {
     struct virtqueue *vq;
 	wait_queue_head_t *ack;